@@ -0,0 +1,168 @@
+#!/bin/sh
+#
+# Copyright (c) 2023 Vicharak Computer LLP.
+#
+# Benchmark suite: hex conversion, full flash, verify and --partition diff
+# for every combination of image size, erase size and change ratio. Runs
+# against fcp's file-backed NOR simulator by default, or against an mtdram
+# device with BENCH_MTDRAM=1 (as root), or any MTD device given in
+# BENCH_DEVICE, whose contents are destroyed.
+#
+# Settings, from the environment:
+#   BENCH_SIZES     image sizes in KiB            (default "1024 4096")
+#   BENCH_ERASE     erase sizes in KiB            (default "4 64")
+#   BENCH_CHANGE    changed blocks in % for diff  (default "1 10 50")
+#   BENCH_RUNS      runs per case, the median is reported (default 3)
+#   BENCH_IO        fcp --io-engine               (default sync)
+#   BENCH_SIM       simulator latencies, e.g.
+#                   "erase_us=400,program_us=50,read_us=10" (default none)
+#   BENCH_DIR       scratch directory             (default /tmp/fcp-bench)
+#   BENCH_OUT       results, tab separated        (default bench.tsv)
+#   BENCH_BASELINE  results of an earlier run; cases more than
+#                   BENCH_TOLERANCE % (default 10) slower fail the suite
+#
+# Usage: make bench, or ./bench.sh after make fcp
+
+set -e
+
+SIZES=${BENCH_SIZES:-1024 4096}
+ERASE=${BENCH_ERASE:-4 64}
+CHANGE=${BENCH_CHANGE:-1 10 50}
+RUNS=${BENCH_RUNS:-3}
+IO=${BENCH_IO:-sync}
+DIR=${BENCH_DIR:-/tmp/fcp-bench}
+OUT=${BENCH_OUT:-bench.tsv}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+FCP=$(pwd)/fcp
+
+mkdir -p "$DIR"
+
+# image of $1 KiB as Efinix hex, and a copy with $3 % of the $2 KiB
+# blocks changed; the same on every run
+gen_images() {
+	awk -v kib="$1" -v esz="$(($2 * 1024))" -v pct="$3" \
+	    -v base="$DIR/base.hex" -v new="$DIR/new.hex" 'BEGIN {
+		srand(1);
+		size = kib * 1024;
+		blocks = int((size + esz - 1) / esz);
+		changed = int(blocks * pct / 100 + 0.5);
+		if (pct > 0 && changed == 0)
+			changed = 1;
+		for (k = 0; k < changed; k++)
+			hit[int(k * blocks / changed) * esz + int(esz / 2)] = 1;
+		for (i = 0; i < size; i++) {
+			b = int(rand() * 256);
+			printf "%02x\n", b > base;
+			printf "%02x\n", ((i in hit) ? 255 - b : b) > new;
+		}
+	}'
+}
+
+# the mtdram device for erase size $1 KiB, big enough for $2 KiB
+mtdram_device() {
+	modprobe -r mtdram 2>/dev/null || true
+	modprobe mtdram total_size="$2" erase_size="$1"
+	sed -n 's/^\(mtd[0-9]*\):.*"mtdram test device"$/\/dev\/\1/p' \
+		/proc/mtd
+}
+
+# run fcp on the flash, keeping its --stats=json line
+fcp_run() {
+	"$FCP" -d "$DEV" $BACKEND -I "$IO" --cache=0 --stats=json "$@" > "$DIR/out" 2>&1 ||
+		{ cat "$DIR/out" >&2; echo "fcp $* failed" >&2; exit 1; }
+	grep '^{"device"' "$DIR/out"
+}
+
+# median over the runs in $DIR/$1 of field $3 of phase $2; phase "all"
+# sums the wall time of every phase
+median() {
+	awk -v phase="$2" -v key="$3" '
+	function get(line, p, k,	i) {
+		i = index(line, "\"" p "\":{");
+		if (!i)
+			return 0;
+		line = substr(line, i);
+		return substr(line, index(line, "\"" k "\":") + length(k) + 3) + 0;
+	}
+	{
+		if (phase != "all") {
+			v[NR] = get($0, phase, key);
+			next;
+		}
+		n = split("convert bringup erase write verify diff handover", p);
+		for (i = 1; i <= n; i++)
+			v[NR] += get($0, p[i], "wall_ms");
+	}
+	END {
+		for (i = 2; i <= NR; i++)
+			for (j = i; j > 1 && v[j - 1] > v[j]; j--) {
+				t = v[j]; v[j] = v[j - 1]; v[j - 1] = t;
+			}
+		m = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2;
+		printf "%.2f", m;
+	}' "$DIR/$1"
+}
+
+printf 'size_kib\terase_kib\tchange_pct\tconvert_ms\terase_ms\twrite_ms\twrite_mb_s\tverify_ms\tflash_ms\tdiff_ms\n' > "$OUT"
+
+for kib in $SIZES; do
+for esz in $ERASE; do
+	BACKEND=
+	if [ "$BENCH_MTDRAM" = 1 ]; then
+		# round the device up to whole erase blocks
+		DEV=$(mtdram_device "$esz" $(((kib + esz - 1) / esz * esz)))
+		[ -n "$DEV" ] || { echo "mtdram is not available" >&2; exit 1; }
+	elif [ -n "$BENCH_DEVICE" ]; then
+		DEV=$BENCH_DEVICE
+	else
+		DEV=$DIR/flash.img
+		BACKEND="--backend=sim:erasesize=${esz}k${BENCH_SIM:+,$BENCH_SIM}"
+		head -c $(((kib + esz - 1) / esz * esz * 1024)) /dev/zero > "$DEV"
+	fi
+
+	for pct in $CHANGE; do
+		gen_images "$kib" "$esz" "$pct"
+		: > "$DIR/full"
+		: > "$DIR/diff"
+
+		run=0
+		while [ $run -lt "$RUNS" ]; do
+			fcp_run -M "$DIR/manifest" "$DIR/base.hex" >> "$DIR/full"
+			fcp_run -M "$DIR/manifest" -p "$DIR/new.hex" >> "$DIR/diff"
+			run=$((run + 1))
+		done
+
+		printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+			"$kib" "$esz" "$pct" \
+			"$(median full convert wall_ms)" \
+			"$(median full erase wall_ms)" \
+			"$(median full write wall_ms)" \
+			"$(median full write mb_s)" \
+			"$(median full verify wall_ms)" \
+			"$(median full all)" \
+			"$(median diff diff wall_ms)" >> "$OUT"
+	done
+done
+done
+
+[ "$BENCH_MTDRAM" = 1 ] && modprobe -r mtdram 2>/dev/null
+
+column -t -s "$(printf '\t')" "$OUT" 2>/dev/null || cat "$OUT"
+
+[ -n "$BENCH_BASELINE" ] || exit 0
+
+# compare the total flash and diff times case by case
+echo
+awk -F '\t' -v tol="$TOLERANCE" '
+	NR == FNR { flash[$1 FS $2 FS $3] = $9; diff[$1 FS $2 FS $3] = $10; next }
+	FNR == 1 || !(($1 FS $2 FS $3) in flash) { next }
+	{
+		k = $1 FS $2 FS $3;
+		df = flash[k] > 0 ? ($9 - flash[k]) * 100 / flash[k] : 0;
+		dd = diff[k] > 0 ? ($10 - diff[k]) * 100 / diff[k] : 0;
+		bad = df > tol || dd > tol;
+		printf "%6s KiB %4s KiB %3s%%  flash %+6.1f%%  diff %+6.1f%%%s\n",
+			$1, $2, $3, df, dd, bad ? "  REGRESSION" : "";
+		failed += bad;
+	}
+	END { exit failed > 0 }' "$BENCH_BASELINE" "$OUT"
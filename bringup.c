@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Flash bring-up without helper processes: module state comes from
+ * /proc/modules, modules are loaded with finit_module() using the paths in
+ * modules.dep, and the device node is awaited with inotify.
+ */
+
+#include "flashcp.h"
+#include "bringup.h"
+#include <libgen.h>
+#include <limits.h>
+#include <linux/module.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/utsname.h>
+#include <time.h>
+
+/* copy @src to @dst as a module name, i.e. with '-' spelled '_' */
+static void module_name(char *dst, size_t len, const char *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len && i < n; i++)
+		dst[i] = src[i] == '-' ? '_' : src[i];
+	dst[i] = '\0';
+}
+
+/**
+ * @brief Check if a kernel module is loaded.
+ *
+ * @param name The module name, '-' and '_' are interchangeable.
+ * @return 1 if the module is loaded, 0 if not.
+ */
+int module_is_loaded(const char *name)
+{
+	char line[512], want[64], have[64];
+	int loaded = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/modules", "r");
+	if (!fp)
+		return 0;
+
+	module_name(want, sizeof(want), name, strlen(name));
+	while (fgets(line, sizeof(line), fp)) {
+		module_name(have, sizeof(have), line, strcspn(line, " "));
+		if (!strcmp(have, want)) {
+			loaded = 1;
+			break;
+		}
+	}
+
+	fclose(fp);
+	return loaded;
+}
+
+/* name of the module at @path, without directories and extensions */
+static void module_name_of(char *dst, size_t len, const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+	module_name(dst, len, base, strcspn(base, "."));
+}
+
+static int load_file(const char *release, const char *path)
+{
+	char full[PATH_MAX], name[64];
+	const char *ext;
+	int fd, ret, flags = 0;
+
+	module_name_of(name, sizeof(name), path);
+	if (module_is_loaded(name))
+		return 0;
+
+	if (path[0] == '/')
+		snprintf(full, sizeof(full), "%s", path);
+	else
+		snprintf(full, sizeof(full), "%s/%s/%s", MODULES_DIR, release,
+			 path);
+
+	/* let the kernel decompress .ko.xz/.ko.zst/.ko.gz itself */
+	ext = strrchr(full, '.');
+	if (ext && strcmp(ext, ".ko"))
+		flags |= MODULE_INIT_COMPRESSED_FILE;
+
+	fd = open(full, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = syscall(__NR_finit_module, fd, "", flags);
+	close(fd);
+
+	if (ret < 0 && errno != EEXIST) {
+		log_verbose("finit_module(%s): %m\n", full);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Load @p name and the modules it depends on, like modprobe.
+ *
+ * @return 0 on success, -1 if the module is not in modules.dep or could
+ * not be loaded (e.g. compressed and the kernel cannot decompress it).
+ */
+int module_load(const char *name)
+{
+	char path[PATH_MAX], want[64], have[64], *line = NULL, *deps, *dep;
+	char *list[32];
+	struct utsname uts;
+	size_t len = 0;
+	int i, nr, ret = -1;
+	FILE *fp;
+
+	if (uname(&uts) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s/modules.dep", MODULES_DIR,
+		 uts.release);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	module_name(want, sizeof(want), name, strlen(name));
+	while (getline(&line, &len, fp) != -1) {
+		deps = strchr(line, ':');
+		if (!deps)
+			continue;
+		*deps++ = '\0';
+
+		module_name_of(have, sizeof(have), line);
+		if (strcmp(have, want))
+			continue;
+
+		/* dependencies are listed so the last one loads first */
+		nr = 0;
+		for (dep = strtok(deps, " \t\n"); dep && nr < 32;
+		     dep = strtok(NULL, " \t\n"))
+			list[nr++] = dep;
+
+		ret = 0;
+		for (i = nr - 1; i >= 0 && !ret; i--)
+			ret = load_file(uts.release, list[i]);
+		if (!ret)
+			ret = load_file(uts.release, line);
+		break;
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Wait up to @p timeout_ms for @p path to appear.
+ *
+ * Watches the parent directory with inotify, so it returns as soon as the
+ * node is created. Polls every 10 ms if inotify is not available.
+ *
+ * @return 0 once @p path exists, -1 on timeout.
+ */
+int wait_for_path(const char *path, int timeout_ms)
+{
+	char events[4096], *dir;
+	long long deadline = now_ms() + timeout_ms, left;
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	int ret = 0;
+
+	dir = strdup(path);
+	if (dir) {
+		pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		/* watch before checking, so the creation cannot be missed */
+		if (pfd.fd >= 0 &&
+		    inotify_add_watch(pfd.fd, dirname(dir),
+				      IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+			close(pfd.fd);
+			pfd.fd = -1;
+		}
+		free(dir);
+	}
+
+	while (access(path, F_OK)) {
+		left = deadline - now_ms();
+		if (left <= 0) {
+			ret = -1;
+			break;
+		}
+
+		if (pfd.fd < 0) {
+			usleep(10000);
+			continue;
+		}
+		if (poll(&pfd, 1, left) > 0)
+			while (read(pfd.fd, events, sizeof(events)) > 0)
+				;
+	}
+
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+	return ret;
+}
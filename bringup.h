@@ -0,0 +1,10 @@
+#ifndef BRINGUP_H
+#define BRINGUP_H
+
+#define MODULES_DIR "/lib/modules"
+
+int module_is_loaded(const char *name);
+int module_load(const char *name);
+int wait_for_path(const char *path, int timeout_ms);
+
+#endif /* BRINGUP_H */
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Content addressed cache of decoded images. Every entry is a header, the
+ * image at CACHE_DATA_OFFSET so it can be mapped in place, and the per
+ * erase block CRC32C of the image. A small ref file per input path
+ * remembers the key of the file as last seen, so an unchanged input is
+ * never read at all.
+ */
+
+#include "flashcp.h"
+#include "cache.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* where the image starts in an entry, a multiple of any page size */
+#define CACHE_DATA_OFFSET (64 * 1024)
+
+#define CACHE_PATH_LEN (sizeof(CACHE_DIR) + CACHE_KEY_LEN + 16)
+
+struct cache_header {
+	char magic[8];
+	uint64_t input_size;
+	uint64_t image_size;
+	uint32_t image_crc;
+	uint32_t erasesize;
+	uint32_t nr_blocks;
+	/* CRC32C of the per block digests */
+	uint32_t digests_crc;
+};
+
+/* the key of an input file, valid while the file is not modified */
+struct cache_ref {
+	char magic[8];
+	uint64_t dev, ino, size;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t ctime_sec, ctime_nsec;
+	char key[CACHE_KEY_LEN];
+};
+
+/* one entry or ref file, while looking for the least recently used */
+struct cache_file {
+	char name[CACHE_KEY_LEN + 8];
+	uint64_t bytes;
+	struct timespec used;
+};
+
+/*
+ * Content key of @inp: the SHA-256 of its data, in hex. A key that two
+ * inputs share would flash one's image for the other without any error,
+ * so a fast but weak hash will not do.
+ */
+static int hash_file(const char *inp, const struct stat *st, char *key,
+		     size_t len)
+{
+	uint8_t digest[SHA256_LEN], *map;
+	int fd, i;
+
+	if (len < CACHE_KEY_LEN)
+		return -1;
+
+	fd = open(inp, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	madvise(map, st->st_size, MADV_SEQUENTIAL);
+	madvise(map, st->st_size, MADV_WILLNEED);
+	sha256(map, st->st_size, digest);
+	munmap(map, st->st_size);
+
+	for (i = 0; i < SHA256_LEN; i++)
+		sprintf(key + 2 * i, "%02x", digest[i]);
+	return 0;
+}
+
+static int write_at(int fd, const void *buf, size_t count, off_t off)
+{
+	const uint8_t *p = buf;
+	ssize_t result;
+
+	while (count) {
+		result = pwrite(fd, p, count, off);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += result;
+		count -= result;
+		off += result;
+	}
+
+	return 0;
+}
+
+static void make_dir(void)
+{
+	mkdir(MANIFEST_DIR, 0755);
+	mkdir(CACHE_DIR, 0755);
+}
+
+/* the ref file of @inp, by the CRC32C of its absolute path */
+static int ref_path(const char *inp, char *path, size_t len)
+{
+	char *abs = realpath(inp, NULL);
+
+	if (!abs)
+		return -1;
+	snprintf(path, len, "%s/%08x.ref", CACHE_DIR,
+		 crc32c(0, abs, strlen(abs)));
+	free(abs);
+	return 0;
+}
+
+static void ref_fill(struct cache_ref *ref, const struct stat *st)
+{
+	memset(ref, 0, sizeof(*ref));
+	memcpy(ref->magic, CACHE_REF_MAGIC, sizeof(ref->magic));
+	ref->dev = st->st_dev;
+	ref->ino = st->st_ino;
+	ref->size = st->st_size;
+	ref->mtime_sec = st->st_mtim.tv_sec;
+	ref->mtime_nsec = st->st_mtim.tv_nsec;
+	ref->ctime_sec = st->st_ctim.tv_sec;
+	ref->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/*
+ * The key of @inp from its ref file if the file is the same one, with the
+ * same size and times, as when the ref was written.
+ */
+static int ref_load(const char *path, const struct stat *st, char *key)
+{
+	struct cache_ref ref, now;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &ref, sizeof(ref), 0) != sizeof(ref)) {
+		close(fd);
+		return -1;
+	}
+	/* a ref used is as recent as the entry it points to */
+	futimens(fd, NULL);
+	close(fd);
+
+	ref_fill(&now, st);
+	memcpy(now.key, ref.key, sizeof(now.key));
+	if (memcmp(&ref, &now, sizeof(ref)) ||
+	    !memchr(ref.key, '\0', sizeof(ref.key)))
+		return -1;
+
+	strcpy(key, ref.key);
+	return 0;
+}
+
+static void ref_save(const char *path, const struct stat *st, const char *key)
+{
+	char tmp[CACHE_PATH_LEN + 16];
+	struct cache_ref ref;
+	int fd;
+
+	ref_fill(&ref, st);
+	strcpy(ref.key, key);
+
+	make_dir();
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	if (write_at(fd, &ref, sizeof(ref), 0) < 0 || close(fd) < 0 ||
+	    rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/**
+ * @brief Look up the decoded image of @p inp.
+ *
+ * Regular files only. The content key is taken from the ref of @p inp if
+ * its device, inode, size and times did not change, else the file is
+ * hashed and the ref updated. A found image is checked against its
+ * CRC32C and mapped read only.
+ *
+ * @param image Returns the image, to be released with munmap().
+ * @param size  Returns the size of the image.
+ * @return 0 if the image was found, -1 if it must be decoded.
+ */
+int cache_lookup(struct cache *c, const char *inp, uint8_t **image,
+		 size_t *size)
+{
+	char ref[CACHE_PATH_LEN], path[CACHE_PATH_LEN];
+	struct cache_header hdr;
+	struct stat st, est;
+	uint8_t *map;
+	size_t bytes;
+	int fd, has_ref;
+
+	c->key[0] = '\0';
+	c->hit = c->digests = 0;
+	c->crc = NULL;
+
+	if (!c->limit || stat(inp, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    !st.st_size)
+		return -1;
+	c->input_size = st.st_size;
+
+	has_ref = ref_path(inp, ref, sizeof(ref)) == 0;
+	if (!has_ref || ref_load(ref, &st, c->key) < 0) {
+		if (hash_file(inp, &st, c->key, sizeof(c->key)) < 0) {
+			c->key[0] = '\0';
+			return -1;
+		}
+		if (has_ref)
+			ref_save(ref, &st, c->key);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.img", CACHE_DIR, c->key);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.input_size != (uint64_t)st.st_size || !hdr.image_size ||
+	    hdr.image_size > SIZE_MAX || !hdr.erasesize ||
+	    hdr.nr_blocks !=
+		    (hdr.image_size + hdr.erasesize - 1) / hdr.erasesize ||
+	    fstat(fd, &est) < 0)
+		goto stale;
+
+	/* a short entry would fault while the image is read */
+	bytes = (size_t)hdr.nr_blocks * sizeof(*c->crc);
+	if ((uint64_t)est.st_size < CACHE_DATA_OFFSET + hdr.image_size + bytes)
+		goto stale;
+
+	map = mmap(NULL, hdr.image_size, PROT_READ, MAP_PRIVATE, fd,
+		   CACHE_DATA_OFFSET);
+	if (map == MAP_FAILED)
+		goto err;
+	madvise(map, hdr.image_size, MADV_WILLNEED);
+	if (crc32c(0, map, hdr.image_size) != hdr.image_crc) {
+		munmap(map, hdr.image_size);
+		goto stale;
+	}
+
+	/* without its digests the image is still good */
+	c->crc = malloc(bytes);
+	if (c->crc &&
+	    (pread(fd, c->crc, bytes, CACHE_DATA_OFFSET + hdr.image_size) !=
+		     (ssize_t)bytes ||
+	     crc32c(0, c->crc, bytes) != hdr.digests_crc)) {
+		free(c->crc);
+		c->crc = NULL;
+	}
+
+	/* most recently used */
+	futimens(fd, NULL);
+	close(fd);
+
+	c->hit = 1;
+	c->image_size = hdr.image_size;
+	c->image_crc = hdr.image_crc;
+	c->erasesize = hdr.erasesize;
+	c->nr_blocks = hdr.nr_blocks;
+	*image = map;
+	*size = hdr.image_size;
+	return 0;
+
+stale:
+	log_verbose("Dropping the damaged cache entry %s\n", path);
+	unlink(path);
+err:
+	close(fd);
+	return -1;
+}
+
+/**
+ * @brief Hand the digests stored with a cached image to @p m, if they
+ * are for the erase size of @p mtd.
+ *
+ * @return 0 if @p m was filled in, -1 if it must be built.
+ */
+int cache_digests(struct cache *c, struct manifest *m,
+		  const struct mtd_info_user *mtd)
+{
+	if (!c->hit || !c->crc || c->erasesize != mtd->erasesize) {
+		free(c->crc);
+		c->crc = NULL;
+		return -1;
+	}
+
+	m->erasesize = c->erasesize;
+	m->nr_blocks = c->nr_blocks;
+	m->mtd_size = mtd->size;
+	m->image_size = c->image_size;
+	m->image_crc = c->image_crc;
+	m->crc = c->crc;
+	c->crc = NULL;
+	c->digests = 1;
+	return 0;
+}
+
+static int by_use(const void *a, const void *b)
+{
+	const struct cache_file *fa = a, *fb = b;
+
+	if (fa->used.tv_sec != fb->used.tv_sec)
+		return fa->used.tv_sec < fb->used.tv_sec ? -1 : 1;
+	if (fa->used.tv_nsec != fb->used.tv_nsec)
+		return fa->used.tv_nsec < fb->used.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Remove the least recently used entries and refs beyond @limit bytes */
+static void cache_evict(uint64_t limit)
+{
+	char path[CACHE_PATH_LEN];
+	struct cache_file *files = NULL, *grown;
+	size_t nr = 0, cap = 0, i, len;
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(CACHE_DIR);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len >= sizeof(files->name) || len < 4 ||
+		    (strcmp(de->d_name + len - 4, ".img") &&
+		     strcmp(de->d_name + len - 4, ".ref")))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, de->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 64;
+			grown = realloc(files, cap * sizeof(*files));
+			if (!grown)
+				goto out;
+			files = grown;
+		}
+		strcpy(files[nr].name, de->d_name);
+		/* what it takes on disk, the header padding is a hole */
+		files[nr].bytes = (uint64_t)st.st_blocks * 512;
+		files[nr].used = st.st_mtim;
+		total += files[nr].bytes;
+		nr++;
+	}
+
+	qsort(files, nr, sizeof(*files), by_use);
+	for (i = 0; i < nr && total > limit; i++) {
+		snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, files[i].name);
+		if (unlink(path) == 0 || errno == ENOENT)
+			total -= files[i].bytes;
+	}
+
+out:
+	free(files);
+	closedir(dir);
+}
+
+/**
+ * @brief Add @p image, decoded from the input given to cache_lookup(),
+ * and its digests @p m to the cache, then trim it to its limit.
+ *
+ * Nothing is done if the input could not be keyed or the cache already
+ * holds both. Entries are written to a temporary file and renamed into
+ * place, so readers only ever see whole entries.
+ *
+ * @return 0 on success or if there was nothing to do, -1 on error.
+ */
+int cache_store(struct cache *c, const uint8_t *image, size_t size,
+		const struct manifest *m)
+{
+	char path[CACHE_PATH_LEN], tmp[CACHE_PATH_LEN + 16];
+	size_t bytes = (size_t)m->nr_blocks * sizeof(*m->crc);
+	struct cache_header hdr;
+	int fd;
+
+	if (!c->limit || !c->key[0] || c->digests || !size)
+		return 0;
+	if (size + bytes > c->limit)
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.image_size = size;
+	hdr.image_crc = m->image_crc;
+	hdr.erasesize = m->erasesize;
+	hdr.nr_blocks = m->nr_blocks;
+	hdr.digests_crc = crc32c(0, m->crc, bytes);
+	hdr.input_size = c->input_size;
+
+	make_dir();
+	snprintf(path, sizeof(path), "%s/%s.img", CACHE_DIR, c->key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (write_at(fd, &hdr, sizeof(hdr), 0) < 0 ||
+	    write_at(fd, image, size, CACHE_DATA_OFFSET) < 0 ||
+	    write_at(fd, m->crc, bytes, CACHE_DATA_OFFSET + size) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	cache_evict(c->limit);
+	return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mtd/mtd-user.h>
+#include "manifest.h"
+#include "sha256.h"
+
+/* decoded images kept across runs, see --cache */
+#define CACHE_DIR MANIFEST_DIR "/cache"
+#define CACHE_MAGIC "FCPCACH1"
+#define CACHE_REF_MAGIC "FCPCREF2"
+/* the SHA-256 of the input in hex */
+#define CACHE_KEY_LEN (SHA256_LEN * 2 + 1)
+/* off unless --cache gives a size, it writes every new image out */
+#define CACHE_LIMIT_DEFAULT 0
+
+/*
+ * Decoded images keyed by the content of the input file, each with the
+ * per block digests for the erase size it was last flashed with. The least
+ * recently used entries go once they take more than @limit bytes.
+ */
+struct cache {
+	/* bytes the entries may take, 0 disables the cache */
+	uint64_t limit;
+
+	/* content key and size of the input, no key if it cannot be cached */
+	char key[CACHE_KEY_LEN];
+	uint64_t input_size;
+	/* the image came from the cache, and so did the digests */
+	int hit;
+	int digests;
+
+	/* digests stored with the cached image, until cache_digests() */
+	uint64_t image_size;
+	uint32_t erasesize, nr_blocks, image_crc;
+	uint32_t *crc;
+};
+
+int cache_lookup(struct cache *c, const char *inp, uint8_t **image,
+		 size_t *size);
+int cache_digests(struct cache *c, struct manifest *m,
+		  const struct mtd_info_user *mtd);
+int cache_store(struct cache *c, const uint8_t *image, size_t size,
+		const struct manifest *m);
+
+#endif /* CACHE_H */
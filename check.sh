@@ -0,0 +1,276 @@
+#!/bin/sh
+#
+# Copyright (c) 2023 Vicharak Computer LLP.
+#
+# Functional tests: flash generated images through fcp's file-backed NOR
+# simulator and compare the flash with what should be on it. Covers input
+# format detection (also of malformed files), compressed input, Intel HEX
+# gaps, --partition with a good and a stale manifest, --no-manifest,
+# --resume after an interrupted flash and erase regions. Needs no root,
+# all state is kept in the scratch directory.
+#
+# Settings, from the environment:
+#   CHECK_DIR       scratch directory             (default /tmp/fcp-check)
+#
+# Usage: make check, or ./check.sh after make fcp
+
+DIR=${CHECK_DIR:-/tmp/fcp-check}
+FCP=$(pwd)/fcp
+SIM=sim:erasesize=4k
+FLASH=$DIR/flash.img
+
+# image size, not a multiple of the erase size, and the Intel HEX gap
+SIZE=307323
+GAP_START=100000
+GAP_END=140000
+
+passed=0
+failed=0
+skipped=0
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+
+# one "xx" line per byte of file $1, i.e. Efinix hex
+to_hex() {
+	od -An -v -tx1 "$1" | tr -s ' ' '\n' | sed '/^$/d'
+}
+
+# Intel HEX of the Efinix hex on stdin, 16 bytes per record, leaving out
+# bytes $1 up to $2
+to_ihex() {
+	awk -v gs="$1" -v ge="$2" '
+	function byte(s,		hi) {
+		hi = index(digits, substr(s, 1, 1)) - 1;
+		return hi * 16 + index(digits, substr(s, 2)) - 1;
+	}
+	function record(addr, type, d,		sum, i) {
+		sum = length(d) / 2 + int(addr / 256) + addr % 256 + type;
+		for (i = 1; i < length(d); i += 2)
+			sum += byte(substr(d, i, 2));
+		printf ":%02X%04X%02X%s%02X\n", length(d) / 2, addr, type,
+			toupper(d), (256 - sum % 256) % 256;
+	}
+	function flush() {
+		if (data == "")
+			return;
+		if (int(start / 65536) != upper) {
+			upper = int(start / 65536);
+			record(0, 4, sprintf("%04x", upper));
+		}
+		record(start % 65536, 0, data);
+		data = "";
+	}
+	BEGIN { digits = "0123456789abcdef"; upper = 0 }
+	{
+		addr = NR - 1;
+		if (addr >= gs && addr < ge) {
+			flush();
+			next;
+		}
+		if (data == "")
+			start = addr;
+		data = data $1;
+		if (length(data) == 32)
+			flush();
+	}
+	END { flush(); print ":00000001FF" }'
+}
+
+# $1 bytes of 0xff
+erased() {
+	head -c "$1" /dev/zero | tr '\000' '\377'
+}
+
+# run fcp on the simulated flash, with its manifest and journal in $DIR
+fcp_run() {
+	"$FCP" -d "$FLASH" -b "$SIM" -M "$DIR/manifest" -J "$DIR/journal" \
+		"$@" > "$DIR/out" 2>&1
+}
+
+# does the flash start with the contents of file $1
+flash_is() {
+	head -c "$(wc -c < "$1")" "$FLASH" | cmp -s - "$1"
+}
+
+# did the last fcp run print $1
+printed() {
+	tr '\r' '\n' < "$DIR/out" | grep -q "$1"
+}
+
+# run test function $2 (with its arguments), named $1; it returns 77 if
+# it cannot run here
+check() {
+	$2
+	case $? in
+	0)
+		echo "PASS $1"
+		passed=$((passed + 1))
+		;;
+	77)
+		echo "SKIP $1"
+		skipped=$((skipped + 1))
+		;;
+	*)
+		echo "FAIL $1"
+		sed 's/^/    /' "$DIR/out"
+		failed=$((failed + 1))
+		;;
+	esac
+}
+
+# fcp must reject file $1, naming line $2, and leave the flash alone
+rejects() {
+	cp "$FLASH" "$DIR/before.img"
+	! fcp_run "$1" && printed "at line $2" &&
+		cmp -s "$FLASH" "$DIR/before.img"
+}
+
+head -c "$SIZE" /dev/urandom > "$DIR/img.bin"
+to_hex "$DIR/img.bin" > "$DIR/img.hex"
+to_ihex "$GAP_START" "$GAP_END" < "$DIR/img.hex" > "$DIR/img.ihex"
+{
+	head -c "$GAP_START" "$DIR/img.bin"
+	erased $((GAP_END - GAP_START))
+	tail -c $((SIZE - GAP_END)) "$DIR/img.bin"
+} > "$DIR/gap.bin"
+
+# the same image with a few bytes changed in two blocks
+cp "$DIR/img.bin" "$DIR/new.bin"
+printf 'fcp' | dd of="$DIR/new.bin" bs=1 seek=70000 conv=notrunc 2>/dev/null
+printf 'fcp' | dd of="$DIR/new.bin" bs=1 seek=250000 conv=notrunc 2>/dev/null
+to_hex "$DIR/new.bin" > "$DIR/new.hex"
+
+head -c 1048576 /dev/zero > "$FLASH"
+
+t_efinix() {
+	fcp_run "$DIR/img.hex" && flash_is "$DIR/img.bin"
+}
+
+t_raw() {
+	fcp_run -A "$DIR/img.bin" && flash_is "$DIR/img.bin"
+}
+
+# the content decides, not the name
+t_hex_named_bin() {
+	cp "$DIR/img.hex" "$DIR/hex.bin"
+	fcp_run "$DIR/hex.bin" && flash_is "$DIR/img.bin"
+}
+
+t_ihex_gap() {
+	fcp_run "$DIR/img.ihex" && flash_is "$DIR/gap.bin"
+}
+
+t_bad_digit() {
+	{ echo 0g; sed 1d "$DIR/img.hex"; } > "$DIR/bad.hex"
+	rejects "$DIR/bad.hex" 1
+}
+
+t_crlf() {
+	awk '{ printf "%s\r\n", $0 }' "$DIR/img.hex" > "$DIR/crlf.hex"
+	rejects "$DIR/crlf.hex" 1
+}
+
+t_text() {
+	echo "not a bitstream" > "$DIR/text.hex"
+	rejects "$DIR/text.hex" 1
+}
+
+t_ihex_checksum() {
+	awk 'NR == 5 {
+		c = substr($0, length($0) - 1);
+		$0 = substr($0, 1, length($0) - 2) (c == "00" ? "01" : "00");
+	} 1' "$DIR/img.ihex" > "$DIR/bad.ihex"
+	rejects "$DIR/bad.ihex" 5
+}
+
+# Efinix hex compressed with command $1, if it is installed and this
+# build of fcp has the format
+t_compressed() {
+	command -v "$1" > /dev/null || return 77
+	"$1" -c "$DIR/img.hex" > "$DIR/img.hex.$1"
+	if ! fcp_run "$DIR/img.hex.$1"; then
+		printed "does not support" && return 77
+		return 1
+	fi
+	flash_is "$DIR/img.bin"
+}
+
+# the manifest spares reading back the blocks it vouches for, all but
+# the few sampled to see it is not stale
+t_manifest() {
+	fcp_run "$DIR/img.hex" && [ -f "$DIR/manifest" ] || return 1
+	fcp_run --stats=json -p "$DIR/new.hex" && flash_is "$DIR/new.bin" &&
+		[ "$(sed -n 's/.*"diff":{[^}]*"bytes":\([0-9]*\).*/\1/p' \
+			"$DIR/out")" -lt $((SIZE / 4)) ]
+}
+
+# written behind the manifest's back, in the first block the new image
+# keeps, which is always sampled
+t_stale_manifest() {
+	fcp_run "$DIR/img.hex" && [ -f "$DIR/manifest" ] || return 1
+	printf 'junk' | dd of="$FLASH" bs=1 seek=100 conv=notrunc 2>/dev/null
+	fcp_run -v -p "$DIR/new.hex" && printed "is stale" &&
+		flash_is "$DIR/new.bin"
+}
+
+t_no_manifest() {
+	fcp_run "$DIR/img.hex" && [ -f "$DIR/manifest" ] || return 1
+	fcp_run -N "$DIR/new.hex" && [ ! -e "$DIR/manifest" ] &&
+		flash_is "$DIR/new.bin"
+}
+
+# 4 KiB sectors below 64 KiB blocks: the image spans both, and only the
+# sectors it touches in the first region are erased
+t_regions() {
+	head -c 1048576 /dev/zero > "$DIR/regions.img"
+	"$FCP" -d "$DIR/regions.img" -b sim:regions=4kx16+64kx15 \
+		-M "$DIR/regions.manifest" -J "$DIR/journal" \
+		"$DIR/img.hex" > "$DIR/out" 2>&1 &&
+	head -c "$SIZE" "$DIR/regions.img" | cmp -s - "$DIR/img.bin" &&
+	"$FCP" -d "$DIR/regions.img" -b sim:regions=4kx16+64kx15 \
+		-M "$DIR/regions.manifest" -J "$DIR/journal" \
+		-p "$DIR/new.hex" > "$DIR/out" 2>&1 &&
+	head -c "$SIZE" "$DIR/regions.img" | cmp -s - "$DIR/new.bin" || return 1
+
+	head -c 10000 "$DIR/img.bin" > "$DIR/small.bin"
+	head -c 1048576 /dev/zero > "$DIR/regions.img"
+	"$FCP" -d "$DIR/regions.img" -b sim:regions=4kx16+64kx15 -N \
+		-J "$DIR/journal" "$DIR/small.bin" > "$DIR/out" 2>&1 &&
+	head -c 10000 "$DIR/regions.img" | cmp -s - "$DIR/small.bin" &&
+	[ "$(od -An -tx1 -j 12288 -N 1 "$DIR/regions.img")" = " 00" ]
+}
+
+# power lost in the middle of a slow flash, after the journal was written
+# once more than when the run started
+t_resume() {
+	fcp_run -A "$DIR/new.hex" || return 1
+	"$FCP" -d "$FLASH" -b "$SIM,page=256,program_us=6000" -N \
+		-J "$DIR/journal" "$DIR/img.hex" > "$DIR/out" 2>&1 &
+	sleep 3
+	kill -KILL $! 2>/dev/null
+	wait $! 2>/dev/null
+	[ -f "$DIR/journal" ] && ! flash_is "$DIR/img.bin" || return 1
+	fcp_run -N -v -R "$DIR/img.hex" && printed "Resuming at" &&
+		[ ! -e "$DIR/journal" ] && flash_is "$DIR/img.bin"
+}
+
+check "Efinix hex" t_efinix
+check "binary image" t_raw
+check "Efinix hex named .bin" t_hex_named_bin
+check "Intel HEX with a gap" t_ihex_gap
+check "gzip compressed hex" "t_compressed gzip"
+check "zstd compressed hex" "t_compressed zstd"
+check "lz4 compressed hex" "t_compressed lz4"
+check "hex with a bad digit" t_bad_digit
+check "hex with CRLF line ends" t_crlf
+check "text that is no hex" t_text
+check "Intel HEX with a bad checksum" t_ihex_checksum
+check "--partition with a manifest" t_manifest
+check "--partition with a stale manifest" t_stale_manifest
+check "--no-manifest drops the manifest" t_no_manifest
+check "--resume after an interrupted flash" t_resume
+check "erase regions" t_regions
+
+echo "$passed passed, $failed failed, $skipped skipped"
+[ "$failed" -eq 0 ]
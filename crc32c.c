@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_HAVE_ARM 1
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] =
+				(crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t w;
+
+	while (len >= 8) {
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc32c_table[7][w & 0xff] ^
+		      crc32c_table[6][(w >> 8) & 0xff] ^
+		      crc32c_table[5][(w >> 16) & 0xff] ^
+		      crc32c_table[4][(w >> 24) & 0xff] ^
+		      crc32c_table[3][(w >> 32) & 0xff] ^
+		      crc32c_table[2][(w >> 40) & 0xff] ^
+		      crc32c_table[1][(w >> 48) & 0xff] ^
+		      crc32c_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(CRC32C_HAVE_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	while (len >= 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+		p += 8;
+		len -= 8;
+	}
+
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+#if defined(CRC32C_HAVE_ARM)
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t w;
+
+	while (len >= 8) {
+		memcpy(&w, p, 8);
+		crc = __crc32cd(crc, w);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static crc32c_fn crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_select(void)
+{
+#if defined(CRC32C_HAVE_SSE42)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_sse42;
+		return;
+	}
+#endif
+#if defined(CRC32C_HAVE_ARM)
+	crc32c_impl = crc32c_arm;
+	return;
+#endif
+	crc32c_init_table();
+	crc32c_impl = crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_select);
+
+	return ~crc32c_impl(~crc, buf, len);
+}
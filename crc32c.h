@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) of @len bytes at @buf, continuing from @crc (0 for
+ * a fresh checksum). Uses the SSE4.2 or ARMv8 CRC instructions when the
+ * CPU has them and a slicing-by-8 table otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H */
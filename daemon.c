@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Flashing daemon: keeps the SPI flash brought up while jobs arrive on a
+ * UNIX socket, and hands it back to the FPGA once it has been idle for
+ * DAEMON_IDLE_MS. Jobs run one at a time, each in a forked child, so a
+ * failing job (log_failure() exits) cannot take the daemon down.
+ */
+
+#define _GNU_SOURCE
+#include "flashcp.h"
+#include "daemon.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* client's working directory, stdout and stderr */
+#define DAEMON_NR_FDS 3
+
+static volatile sig_atomic_t stop;
+
+/* in a job, where to tell the daemon that the flash was brought up */
+static int hold_fd = -1;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (uint8_t *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* read the request header along with the descriptors attached to it */
+static int recv_header(int conn, struct daemon_request *req, int *fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * DAEMON_NR_FDS)];
+	struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	ret = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	if (ret <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int) * DAEMON_NR_FDS))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * DAEMON_NR_FDS);
+
+	if ((size_t)ret < sizeof(*req) &&
+	    read_full(conn, (uint8_t *)req + ret, sizeof(*req) - ret) < 0)
+		return -2;
+	if (memcmp(req->magic, DAEMON_MAGIC, sizeof(req->magic)) ||
+	    req->len > DAEMON_MAX_REQUEST)
+		return -2;
+
+	return 0;
+}
+
+/* split the NUL terminated arguments into an argv[] after "fcp" */
+static char **split_args(char *buf, uint32_t len, int *argc)
+{
+	char **argv;
+	uint32_t i;
+	int n = 1;
+
+	if (len && buf[len - 1])
+		return NULL;
+
+	for (i = 0; i < len; i++)
+		if (!buf[i])
+			n++;
+
+	argv = calloc(n + 1, sizeof(*argv));
+	if (!argv)
+		return NULL;
+
+	argv[0] = PROGRAM_NAME;
+	for (i = 0, n = 1; i < len; i += strlen(buf + i) + 1)
+		argv[n++] = buf + i;
+
+	*argc = n;
+	return argv;
+}
+
+/**
+ * @brief Tell the daemon that this job brought up the flash, so that it
+ * gets released once the daemon is idle. Does nothing outside a job.
+ */
+void daemon_hold(void)
+{
+	char c = 1;
+
+	if (hold_fd >= 0 && write(hold_fd, &c, 1) != 1)
+		log_verbose("Failed to report the flash bring-up: %m\n");
+}
+
+/*
+ * Run the job sent on @conn and report its exit status back. Returns 1 if
+ * the job brought up the flash, 0 if not, -1 if no job ran.
+ */
+static int serve_job(int conn, daemon_job_fn job)
+{
+	struct daemon_request req;
+	int fds[DAEMON_NR_FDS] = { -1, -1, -1 };
+	int hold[2] = { -1, -1 };
+	int32_t result = -1;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	char *buf = NULL, **argv = NULL, c;
+	int i, argc, status, ret = -1;
+	pid_t pid;
+
+	/* the socket is 0600, but make sure anyway */
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    cred.uid != geteuid())
+		return -1;
+
+	i = recv_header(conn, &req, fds);
+	if (i == -1)
+		return -1;
+	if (i < 0)
+		goto out;
+
+	buf = malloc(req.len ? req.len : 1);
+	if (!buf || read_full(conn, buf, req.len) < 0)
+		goto out;
+	argv = split_args(buf, req.len, &argc);
+	if (!argv)
+		goto out;
+
+	log_verbose("Job:");
+	for (i = 1; i < argc; i++)
+		log_verbose(" %s", argv[i]);
+	log_verbose("\n");
+
+	if (pipe2(hold, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto out;
+
+	pid = fork();
+	if (pid < 0)
+		goto out;
+	if (pid == 0) {
+		if (fchdir(fds[0]) < 0 || dup2(fds[1], STDOUT_FILENO) < 0 ||
+		    dup2(fds[2], STDERR_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		close(conn);
+		close(hold[0]);
+		hold_fd = hold[1];
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		exit(job(argc, argv));
+	}
+
+	close(hold[1]);
+	hold[1] = -1;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			goto out;
+
+	result = WIFEXITED(status) ? WEXITSTATUS(status) :
+				     128 + WTERMSIG(status);
+	log_verbose("Job finished with status %d\n", result);
+	ret = read(hold[0], &c, 1) == 1;
+
+out:
+	if (hold[0] >= 0)
+		close(hold[0]);
+	if (hold[1] >= 0)
+		close(hold[1]);
+	if (write(conn, &result, sizeof(result)) != sizeof(result))
+		log_verbose("Failed to send the job status: %m\n");
+	for (i = 0; i < DAEMON_NR_FDS; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(argv);
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief Serve flashing jobs on the UNIX socket @p path until SIGTERM
+ * or SIGINT.
+ *
+ * The flash is brought up by the first job that needs it, which runs
+ * vicharak_flash_configuration() as usual and reports it with
+ * daemon_hold(), and stays up for the jobs that follow. @p release runs
+ * once no job has arrived for DAEMON_IDLE_MS after that, and on shutdown.
+ * Never returns.
+ */
+void daemon_serve(const char *path, daemon_job_fn job,
+		  daemon_release_fn release)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct pollfd pfd;
+	int fd, conn, ret, held = 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		log_failure("Socket path %s is too long\n", path);
+	strcpy(addr.sun_path, path);
+
+	/* no SA_RESTART, so poll() returns as soon as we are asked to stop */
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		log_failure("Failed to create socket: %m\n");
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0600) < 0 || listen(fd, 16) < 0)
+		log_failure("Failed to listen on %s: %m\n", path);
+
+	log_verbose("Listening on %s\n", path);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		ret = poll(&pfd, 1, held ? DAEMON_IDLE_MS : -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			log_failure("poll() failed: %m\n");
+		}
+
+		if (ret == 0) {
+			log_verbose("Idle, releasing the flash\n");
+			release();
+			held = 0;
+			continue;
+		}
+
+		conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0)
+			continue;
+		/* jobs that never brought up the flash leave nothing to release */
+		if (serve_job(conn, job) > 0)
+			held = 1;
+		close(conn);
+	}
+
+	if (held)
+		release();
+	close(fd);
+	unlink(path);
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Run a job on the daemon listening on @p path.
+ *
+ * The job's output appears on our own stdout and stderr, and relative
+ * paths are resolved in our working directory.
+ *
+ * @return the exit status of the job.
+ */
+int daemon_submit(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct daemon_request req;
+	char control[CMSG_SPACE(sizeof(int) * DAEMON_NR_FDS)];
+	struct iovec iov[2];
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	int fds[DAEMON_NR_FDS], fd, i;
+	char *buf, *p;
+	size_t len = 0;
+	int32_t result;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > DAEMON_MAX_REQUEST)
+		log_failure("Too many arguments for %s\n", path);
+
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		log_failure("Malloc failed");
+	for (i = 0, p = buf; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	if (fds[0] < 0)
+		log_failure("Failed to open the working directory: %m\n");
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		log_failure("Socket path %s is too long\n", path);
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		log_failure("Failed to connect to %s: %m\n", path);
+
+	memcpy(req.magic, DAEMON_MAGIC, sizeof(req.magic));
+	req.len = len;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != (ssize_t)(sizeof(req) + len))
+		log_failure("Failed to send the job to %s: %m\n", path);
+
+	/* blocks while earlier jobs are queued and while ours runs */
+	if (read_full(fd, &result, sizeof(result)) < 0)
+		log_failure("Lost the connection to %s\n", path);
+
+	close(fd);
+	close(fds[0]);
+	free(buf);
+	return result < 0 ? EXIT_FAILURE : result;
+}
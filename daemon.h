@@ -0,0 +1,36 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+
+#define DAEMON_SOCKET "/run/fcp.sock"
+#define DAEMON_MAGIC "FCP1"
+
+/* release the flash after this long without a job */
+#define DAEMON_IDLE_MS 5000
+
+/* longest argument list a client may send */
+#define DAEMON_MAX_REQUEST 65536
+
+/*
+ * A request is this header followed by @len bytes of NUL terminated
+ * arguments, sent with three descriptors attached (SCM_RIGHTS): the
+ * client's working directory, stdout and stderr. The job writes to the
+ * client's own stdout/stderr, and the daemon answers with the job's
+ * exit status as an int32_t.
+ */
+struct daemon_request {
+	char magic[4];
+	uint32_t len;
+};
+
+/* runs one job in a forked child, returns its exit status */
+typedef int (*daemon_job_fn)(int argc, char *argv[]);
+typedef void (*daemon_release_fn)(void);
+
+void daemon_serve(const char *path, daemon_job_fn job,
+		  daemon_release_fn release);
+void daemon_hold(void);
+int daemon_submit(const char *path, int argc, char *argv[]);
+
+#endif /* DAEMON_H */
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Streaming decompression of the input file, so compressed bitstreams are
+ * decoded on the fly without an intermediate file. gzip needs zlib, zstd
+ * and lz4 need their libraries; see HAVE_ZLIB, HAVE_ZSTD and HAVE_LZ4 in
+ * the Makefile.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "decompress.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/* compressed bytes read from the file at a time */
+#define DECOMPRESS_CHUNK (64 * 1024)
+
+struct decompressor {
+	int fd;
+	enum decompress_format format;
+
+	/* compressed input, in[pos, len) not consumed yet */
+	uint8_t *in;
+	size_t pos, len;
+	int eof;
+
+	/* the last member or frame was decoded to its end */
+	int ended;
+
+	union {
+#ifdef HAVE_ZLIB
+		z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+		ZSTD_DStream *zstd;
+#endif
+#ifdef HAVE_LZ4
+		LZ4F_dctx *lz4;
+#endif
+		int none;
+	};
+};
+
+/**
+ * @brief Tell the compression format from the first bytes of the input.
+ *
+ * @return DECOMPRESS_NONE for anything not compressed.
+ */
+enum decompress_format decompress_detect(const uint8_t *head, size_t len)
+{
+	static const uint8_t gzip[] = { 0x1f, 0x8b };
+	static const uint8_t zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	static const uint8_t lz4[] = { 0x04, 0x22, 0x4d, 0x18 };
+
+	if (len >= sizeof(gzip) && !memcmp(head, gzip, sizeof(gzip)))
+		return DECOMPRESS_GZIP;
+	if (len >= sizeof(zstd) && !memcmp(head, zstd, sizeof(zstd)))
+		return DECOMPRESS_ZSTD;
+	if (len >= sizeof(lz4) && !memcmp(head, lz4, sizeof(lz4)))
+		return DECOMPRESS_LZ4;
+	return DECOMPRESS_NONE;
+}
+
+const char *decompress_name(enum decompress_format format)
+{
+	switch (format) {
+	case DECOMPRESS_GZIP:
+		return "gzip";
+	case DECOMPRESS_ZSTD:
+		return "zstd";
+	case DECOMPRESS_LZ4:
+		return "lz4";
+	default:
+		return "uncompressed";
+	}
+}
+
+static int setup(struct decompressor *d)
+{
+	switch (d->format) {
+#ifdef HAVE_ZLIB
+	case DECOMPRESS_GZIP:
+		/* 32 lets zlib take the gzip header */
+		return inflateInit2(&d->z, 15 + 32) == Z_OK ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		d->zstd = ZSTD_createDStream();
+		return d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd)) ?
+			       0 : -1;
+#endif
+#ifdef HAVE_LZ4
+	case DECOMPRESS_LZ4:
+		return LZ4F_isError(LZ4F_createDecompressionContext(
+			       &d->lz4, LZ4F_VERSION)) ? -1 : 0;
+#endif
+	default:
+		errno = ENOTSUP;
+		return -1;
+	}
+}
+
+/* Free the context of the format, also one setup() left half made */
+static void teardown(struct decompressor *d)
+{
+	switch (d->format) {
+#ifdef HAVE_ZLIB
+	case DECOMPRESS_GZIP:
+		inflateEnd(&d->z);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		ZSTD_freeDStream(d->zstd);
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case DECOMPRESS_LZ4:
+		LZ4F_freeDecompressionContext(d->lz4);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*
+ * Decode what the buffered input allows into @buf, setting @produced.
+ * Concatenated gzip members and zstd/lz4 frames are decoded in turn.
+ */
+static int step(struct decompressor *d, uint8_t *buf, size_t count,
+		size_t *produced)
+{
+	switch (d->format) {
+#ifdef HAVE_ZLIB
+	case DECOMPRESS_GZIP: {
+		int ret;
+
+		if (d->ended) {
+			if (d->pos == d->len)
+				return 0;
+			inflateReset(&d->z);
+			d->ended = 0;
+		}
+
+		d->z.next_in = d->in + d->pos;
+		d->z.avail_in = d->len - d->pos;
+		d->z.next_out = buf;
+		d->z.avail_out = count;
+		ret = inflate(&d->z, Z_NO_FLUSH);
+		d->pos = d->len - d->z.avail_in;
+		*produced = count - d->z.avail_out;
+
+		if (ret == Z_STREAM_END)
+			d->ended = 1;
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return -1;
+		return 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD: {
+		ZSTD_inBuffer in = { d->in + d->pos, d->len - d->pos, 0 };
+		ZSTD_outBuffer out = { buf, count, 0 };
+		size_t ret;
+
+		ret = ZSTD_decompressStream(d->zstd, &out, &in);
+		if (ZSTD_isError(ret))
+			return -1;
+		d->pos += in.pos;
+		*produced = out.pos;
+		/* 0 once a frame is decoded and flushed */
+		d->ended = ret == 0;
+		return 0;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case DECOMPRESS_LZ4: {
+		size_t out_len = count, in_len = d->len - d->pos;
+		size_t ret;
+
+		ret = LZ4F_decompress(d->lz4, buf, &out_len, d->in + d->pos,
+				      &in_len, NULL);
+		if (LZ4F_isError(ret))
+			return -1;
+		d->pos += in_len;
+		*produced = out_len;
+		d->ended = ret == 0;
+		return 0;
+	}
+#endif
+	default:
+		(void)buf;
+		(void)count;
+		(void)produced;
+		return -1;
+	}
+}
+
+/**
+ * @brief Start decompressing @p fd.
+ *
+ * @param head The first @p len bytes of the input, already read from
+ * @p fd to detect the format.
+ * @return the decompressor, NULL with errno ENOTSUP if support for
+ * @p format was not built in.
+ */
+struct decompressor *decompress_open(int fd, enum decompress_format format,
+				     const uint8_t *head, size_t len)
+{
+	struct decompressor *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->in = malloc(DECOMPRESS_CHUNK);
+	if (!d->in || len > DECOMPRESS_CHUNK)
+		goto err;
+
+	d->fd = fd;
+	d->format = format;
+	memcpy(d->in, head, len);
+	d->len = len;
+
+	if (setup(d) < 0) {
+		teardown(d);
+		goto err;
+	}
+	return d;
+
+err:
+	free(d->in);
+	free(d);
+	return NULL;
+}
+
+/**
+ * @brief Read up to @p count decompressed bytes.
+ *
+ * @return the bytes read, 0 at the end of the input, -1 on a read error
+ * or corrupt or truncated input.
+ */
+ssize_t decompress_read(struct decompressor *d, void *buf, size_t count)
+{
+	size_t produced;
+	ssize_t nread;
+
+	for (;;) {
+		if (d->pos == d->len && !d->eof) {
+			nread = read(d->fd, d->in, DECOMPRESS_CHUNK);
+			if (nread < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			d->pos = 0;
+			d->len = nread;
+			d->eof = !nread;
+		}
+
+		/* nothing left to flush once the last frame has ended */
+		if (d->pos == d->len && d->eof && d->ended)
+			return 0;
+
+		produced = 0;
+		if (step(d, buf, count, &produced) < 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+		if (produced)
+			return produced;
+
+		/* the input stops in the middle of a frame */
+		if (d->pos == d->len && d->eof && !d->ended) {
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+}
+
+void decompress_close(struct decompressor *d)
+{
+	if (!d)
+		return;
+
+	teardown(d);
+	free(d->in);
+	free(d);
+}
@@ -0,0 +1,27 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* bytes of input needed to tell the formats apart */
+#define DECOMPRESS_MAGIC_LEN 4
+
+enum decompress_format {
+	DECOMPRESS_NONE,
+	DECOMPRESS_GZIP,
+	DECOMPRESS_ZSTD,
+	DECOMPRESS_LZ4,
+};
+
+struct decompressor;
+
+enum decompress_format decompress_detect(const uint8_t *head, size_t len);
+const char *decompress_name(enum decompress_format format);
+struct decompressor *decompress_open(int fd, enum decompress_format format,
+				     const uint8_t *head, size_t len);
+ssize_t decompress_read(struct decompressor *d, void *buf, size_t count);
+void decompress_close(struct decompressor *d);
+
+#endif /* DECOMPRESS_H */
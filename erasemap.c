@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Erase planning for devices with several erase regions, e.g. NOR parts
+ * with 4 KiB boot sectors next to 64 KiB blocks. mtd.erasesize only
+ * reports the largest block size, so rounding a range to it over-erases
+ * in the small sector regions.
+ */
+
+#include "flashcp.h"
+#include "erasemap.h"
+
+/*
+ * Fetch the erase regions of @f. Devices without regions get a single
+ * synthetic region with the uniform erasesize.
+ */
+static int get_regions(struct flash *f, struct region_info_user **regions)
+{
+	const struct mtd_info_user *mtd = &f->info;
+	struct region_info_user *r;
+	int i, count = f->nr_regions;
+
+	r = calloc(count ? count : 1, sizeof(*r));
+	if (!r)
+		log_failure("Malloc failed");
+
+	for (i = 0; i < count; i++) {
+		if (f->ops->region(f, i, &r[i]) < 0 || !r[i].erasesize) {
+			count = 0;
+			break;
+		}
+	}
+
+	if (!count) {
+		r[0].offset = 0;
+		r[0].erasesize = mtd->erasesize;
+		r[0].numblocks = mtd->size / mtd->erasesize;
+		count = 1;
+	}
+
+	*regions = r;
+	return count;
+}
+
+/**
+ * @brief Plan the erase of [@p start, @p start + @p length).
+ *
+ * The range is rounded out to the erase block size of the region each
+ * end falls into, so only the blocks actually touched get erased.
+ *
+ * @return 0 on success, -1 if the range is not covered by the regions.
+ */
+int erase_map_build(struct erase_map *map, struct flash *f, uint32_t start,
+		    uint32_t length)
+{
+	struct region_info_user *regions;
+	uint64_t end = (uint64_t)start + length;
+	uint64_t covered = start;
+	int i, count;
+
+	count = get_regions(f, &regions);
+
+	map->ext = calloc(count, sizeof(*map->ext));
+	if (!map->ext)
+		log_failure("Malloc failed");
+	map->nr = 0;
+	map->max_unit = 0;
+
+	for (i = 0; i < count && covered < end; i++) {
+		struct region_info_user *r = &regions[i];
+		uint64_t rend = r->offset +
+				(uint64_t)r->erasesize * r->numblocks;
+		uint64_t s, e;
+
+		if (covered < r->offset || covered >= rend)
+			continue;
+
+		s = covered - (covered - r->offset) % r->erasesize;
+		e = end < rend ? end : rend;
+		e += (r->erasesize - (e - r->offset) % r->erasesize) %
+		     r->erasesize;
+
+		map->ext[map->nr].start = s;
+		map->ext[map->nr].length = e - s;
+		map->ext[map->nr].unit = r->erasesize;
+		if (r->erasesize > map->max_unit)
+			map->max_unit = r->erasesize;
+		map->nr++;
+		covered = e;
+	}
+
+	free(regions);
+
+	if (length && (!map->nr || covered < end)) {
+		erase_map_free(map);
+		return -1;
+	}
+
+	map->start = map->nr ? map->ext[0].start : start;
+	map->end = map->nr ? covered : start;
+	return 0;
+}
+
+/* Number of erase blocks in the map */
+unsigned int erase_map_blocks(const struct erase_map *map)
+{
+	unsigned int i, blocks = 0;
+
+	for (i = 0; i < map->nr; i++)
+		blocks += map->ext[i].length / map->ext[i].unit;
+
+	return blocks;
+}
+
+/**
+ * @brief Erase every block of @p map that overlaps [@p start, @p start +
+ * @p length).
+ *
+ * Blocks of the same region are erased with a single MEMERASE, which lets
+ * the driver use its largest erase command for the run.
+ */
+void erase_map_erase(const struct erase_map *map, struct flash *f,
+		     uint32_t start, uint32_t length)
+{
+	uint64_t end = (uint64_t)start + length;
+	unsigned int i;
+
+	for (i = 0; i < map->nr; i++) {
+		const struct erase_extent *x = &map->ext[i];
+		uint64_t s = start > x->start ? start : x->start;
+		uint64_t e = x->start + (uint64_t)x->length;
+
+		if (end < e)
+			e = end;
+		if (s >= e)
+			continue;
+
+		s -= (s - x->start) % x->unit;
+		e += (x->unit - (e - x->start) % x->unit) % x->unit;
+
+		flash_erase(f, s, e - s);
+	}
+}
+
+void erase_map_free(struct erase_map *map)
+{
+	free(map->ext);
+	map->ext = NULL;
+	map->nr = 0;
+}
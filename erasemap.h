@@ -0,0 +1,33 @@
+#ifndef ERASEMAP_H
+#define ERASEMAP_H
+
+#include <stdint.h>
+#include "flash.h"
+
+/*
+ * A contiguous run of erase blocks that all have the same size, i.e. the
+ * part of one MTD erase region that falls inside the range to erase.
+ */
+struct erase_extent {
+	uint32_t start, length;
+	uint32_t unit;
+};
+
+/* Exact erase layout of a range, following the device's erase regions */
+struct erase_map {
+	struct erase_extent *ext;
+	unsigned int nr;
+	/* whole span, rounded out to the erase blocks it touches */
+	uint32_t start, end;
+	/* largest erase block in the map */
+	uint32_t max_unit;
+};
+
+int erase_map_build(struct erase_map *map, struct flash *f, uint32_t start,
+		    uint32_t length);
+void erase_map_erase(const struct erase_map *map, struct flash *f,
+		     uint32_t start, uint32_t length);
+unsigned int erase_map_blocks(const struct erase_map *map);
+void erase_map_free(struct erase_map *map);
+
+#endif /* ERASEMAP_H */
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ */
+
+#include "flashcp.h"
+#include "eraser.h"
+#include "stats.h"
+#include <time.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Record why the eraser stops and wake the writer. Exiting here would
+ * tear down the device and the image under the writer, so the error is
+ * reported on the main thread by eraser_wait() and eraser_finish().
+ */
+static void eraser_fail(struct eraser *e, const char *what, uint32_t start,
+			uint32_t length)
+{
+	int err = errno;
+
+	pthread_mutex_lock(&e->lock);
+	e->error = err;
+	e->error_what = what;
+	e->error_start = start;
+	e->error_end = start + length;
+	pthread_cond_broadcast(&e->progress);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void *eraser_thread(void *arg)
+{
+	struct eraser *e = arg;
+	const struct erase_map *map = e->map;
+	uint32_t limit, next, from;
+	unsigned int x = 0;
+	uint64_t start;
+
+	stats_thread(STATS_ERASE);
+	while (x < map->nr) {
+		const struct erase_extent *ext = &map->ext[x];
+		uint32_t ext_end = ext->start + ext->length;
+
+		pthread_mutex_lock(&e->lock);
+		while (!e->flush && e->erased >= e->cursor + e->ahead)
+			pthread_cond_wait(&e->cursor_moved, &e->lock);
+		limit = e->flush ? ext_end : e->cursor + e->ahead;
+		from = e->erased;
+		pthread_mutex_unlock(&e->lock);
+
+		/*
+		 * Erase as many blocks of this region as the window allows in
+		 * one go, or one at a time when each is checked first.
+		 */
+		next = from + ext->unit;
+		if (!e->blank_check && limit > next) {
+			next += (limit - next) / ext->unit * ext->unit;
+			if (next > ext_end)
+				next = ext_end;
+		}
+		if (e->blank_check) {
+			if (flash_try_read(e->flash, e->buf, ext->unit, from) !=
+			    (ssize_t)ext->unit) {
+				eraser_fail(e, "reading", from, ext->unit);
+				break;
+			}
+			if (is_erased(e->buf, ext->unit)) {
+				e->nr_skipped++;
+				goto done;
+			}
+		}
+
+		start = now_ns();
+		if (flash_try_erase(e->flash, from, next - from) < 0) {
+			eraser_fail(e, "erasing", from, next - from);
+			break;
+		}
+		e->erase_ns += now_ns() - start;
+		e->nr_erased += (next - from) / ext->unit;
+done:
+		if (next == ext_end)
+			x++;
+
+		pthread_mutex_lock(&e->lock);
+		e->erased = next;
+		pthread_cond_broadcast(&e->progress);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	stats_end();
+	return NULL;
+}
+
+/**
+ * @brief Start erasing the blocks of @p map in the background.
+ *
+ * @param ahead  Bytes the eraser may run ahead of the write cursor.
+ * @param blank_check Skip blocks that already read back as all 0xff.
+ */
+void eraser_start(struct eraser *e, struct flash *f,
+		  const struct erase_map *map, uint32_t ahead,
+		  int blank_check)
+{
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->progress, NULL);
+	pthread_cond_init(&e->cursor_moved, NULL);
+	e->flash = f;
+	e->map = map;
+	e->ahead = ahead ? ahead : 1;
+	e->erased = map->start;
+	e->cursor = map->start;
+	e->flush = 0;
+	e->blank_check = blank_check;
+	e->buf = NULL;
+	e->nr_erased = 0;
+	e->nr_skipped = 0;
+	e->erase_ns = 0;
+	e->error = 0;
+
+	if (blank_check) {
+		e->buf = malloc(map->max_unit);
+		if (!e->buf)
+			log_failure("Malloc failed");
+	}
+
+	if (pthread_create(&e->thread, NULL, eraser_thread, e))
+		log_failure("Failed to start the erase thread\n");
+}
+
+/**
+ * @brief Move the write cursor to @p end and wait until everything
+ * before it has been erased.
+ *
+ * @return 0 once it is, -1 if the eraser failed before, see @p e->error.
+ */
+int eraser_wait(struct eraser *e, uint32_t end)
+{
+	int ret;
+
+	pthread_mutex_lock(&e->lock);
+	if (end > e->cursor) {
+		e->cursor = end;
+		pthread_cond_signal(&e->cursor_moved);
+	}
+	while (e->erased < end && !e->error)
+		pthread_cond_wait(&e->progress, &e->lock);
+	ret = e->erased < end ? -1 : 0;
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Erase whatever is left of the range and stop the eraser.
+ *
+ * @return 0 on success, -1 if an erase failed, see @p e->error.
+ */
+int eraser_finish(struct eraser *e)
+{
+	pthread_mutex_lock(&e->lock);
+	e->flush = 1;
+	pthread_cond_signal(&e->cursor_moved);
+	pthread_mutex_unlock(&e->lock);
+
+	pthread_join(e->thread, NULL);
+	free(e->buf);
+	e->buf = NULL;
+	pthread_cond_destroy(&e->cursor_moved);
+	pthread_cond_destroy(&e->progress);
+	pthread_mutex_destroy(&e->lock);
+
+	return e->error ? -1 : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef ERASER_H
+#define ERASER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "erasemap.h"
+#include "flash.h"
+
+/* default number of blocks erased ahead of the write cursor */
+#define ERASE_AHEAD_DEFAULT 4
+
+/*
+ * Background eraser that keeps a bounded number of bytes erased ahead
+ * of the block being programmed, so erasing and writing interleave
+ * instead of running as two back to back passes.
+ */
+struct eraser {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+	pthread_cond_t cursor_moved;
+
+	struct flash *flash;
+	const struct erase_map *map;
+	uint32_t ahead;
+
+	/* end of the erased part of the map, and end needed by the writer */
+	uint32_t erased, cursor;
+	int flush;
+
+	/* read each block first and skip the erase if it is all 0xff */
+	int blank_check;
+	uint8_t *buf;
+
+	/*
+	 * errno of the erase or blank check read that failed, what it was
+	 * doing and where; the eraser stops at the first failure
+	 */
+	int error;
+	const char *error_what;
+	uint32_t error_start, error_end;
+
+	/* blocks erased and skipped, and time spent in MEMERASE */
+	unsigned int nr_erased, nr_skipped;
+	uint64_t erase_ns;
+};
+
+void eraser_start(struct eraser *e, struct flash *f,
+		  const struct erase_map *map, uint32_t ahead,
+		  int blank_check);
+int eraser_wait(struct eraser *e, uint32_t end);
+int eraser_finish(struct eraser *e);
+
+#endif /* ERASER_H */
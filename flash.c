@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Flash backends: the MTD character device, a block device standing in
+ * for the flash, and a file-backed NOR simulator. The flash_* wrappers
+ * check every operation, retry those that fail with a transient error a
+ * few times, and exit if they still fail, like the safe_* helpers. The
+ * flash_try_* variants return the error instead, for the background
+ * threads, which must leave exiting to the main thread.
+ */
+
+#include "flashcp.h"
+#include "flash.h"
+#include "stats.h"
+#include "xfer.h"
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* erase block size of the block and sim backends unless given */
+#define FLASH_DEFAULT_ERASESIZE (64 * 1024)
+
+/* pause before the first retry, doubled for each further one */
+#define FLASH_RETRY_DELAY_MS 10
+
+/*
+ * Parse the "SIZExCOUNT+..." erase regions of the simulator, laid out back
+ * to back from the start of the flash, as MEMGETREGIONINFO would report
+ * them. Like MTD, the erase size becomes that of the largest blocks.
+ */
+static int parse_regions(struct flash *f, char *spec)
+{
+	struct region_info_user *r;
+	char *item, *count, *end, *save;
+	uint64_t offset = 0;
+
+	for (item = strtok_r(spec, "+", &save); item;
+	     item = strtok_r(NULL, "+", &save)) {
+		count = strrchr(item, 'x');
+		if (!count)
+			return -1;
+		*count++ = '\0';
+
+		r = realloc(f->regions, (f->nr_regions + 1) * sizeof(*r));
+		if (!r)
+			log_failure("Malloc failed");
+		f->regions = r;
+		r += f->nr_regions;
+		r->offset = offset;
+		r->erasesize = xfer_parse(item);
+		r->numblocks = strtoul(count, &end, 0);
+		r->regionindex = f->nr_regions++;
+		if (!r->erasesize || !r->numblocks || *end ||
+		    offset % r->erasesize)
+			return -1;
+
+		offset += (uint64_t)r->erasesize * r->numblocks;
+		if (offset > UINT32_MAX)
+			return -1;
+		if (r == f->regions || r->erasesize > f->info.erasesize)
+			f->info.erasesize = r->erasesize;
+	}
+
+	return f->nr_regions ? 0 : -1;
+}
+
+/*
+ * Parse the "key=value,..." options of the block and sim backends: the
+ * erase block size and program page size (k/m suffix), latencies, and
+ * for the simulator its erase regions.
+ */
+static int parse_options(struct flash *f, const char *options)
+{
+	char *copy, *opt, *val, *save;
+	unsigned long num;
+	int ret = 0;
+
+	f->info.erasesize = FLASH_DEFAULT_ERASESIZE;
+	f->page = 256;
+	if (!*options)
+		return 0;
+
+	copy = strdup(options);
+	if (!copy)
+		log_failure("Malloc failed");
+
+	for (opt = strtok_r(copy, ",", &save); opt && !ret;
+	     opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (!val) {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(opt, "erasesize")) {
+			f->info.erasesize = xfer_parse(val);
+			ret = f->info.erasesize ? 0 : -1;
+		} else if (!strcmp(opt, "regions") && f->ops == &flash_sim_ops) {
+			ret = parse_regions(f, val);
+		} else if (!strcmp(opt, "page")) {
+			f->page = xfer_parse(val);
+			ret = f->page ? 0 : -1;
+		} else {
+			num = strtoul(val, NULL, 0);
+			if (!strcmp(opt, "erase_us"))
+				f->erase_us = num;
+			else if (!strcmp(opt, "program_us"))
+				f->program_us = num;
+			else if (!strcmp(opt, "read_us"))
+				f->read_us = num;
+			else
+				ret = -1;
+		}
+	}
+
+	free(copy);
+	if (ret)
+		errno = EINVAL;
+	return ret;
+}
+
+static int check_range(const struct flash *f, uint64_t start, uint64_t length)
+{
+	if (start + length > f->info.size) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t fd_read(struct flash *f, void *buf, size_t count, off_t off)
+{
+	return pread(f->fd, buf, count, off);
+}
+
+static ssize_t fd_program(struct flash *f, const void *buf, size_t count,
+			  off_t off)
+{
+	return pwrite(f->fd, buf, count, off);
+}
+
+/* MTD character device, e.g. /dev/mtd0 */
+
+static int mtd_open(struct flash *f, const char *options)
+{
+	(void)options;
+
+	f->fd = safe_open(f->device, O_SYNC | O_RDWR);
+	if (ioctl(f->fd, MEMGETINFO, &f->info) < 0)
+		log_failure("This doesn't seem to be a valid MTD flash device!\n");
+
+	if (ioctl(f->fd, MEMGETREGIONCOUNT, &f->nr_regions) < 0 ||
+	    f->nr_regions < 0)
+		f->nr_regions = 0;
+	f->direct = 1;
+	return 0;
+}
+
+static int mtd_region(struct flash *f, int index, struct region_info_user *r)
+{
+	r->regionindex = index;
+	return ioctl(f->fd, MEMGETREGIONINFO, r);
+}
+
+static int mtd_erase(struct flash *f, uint32_t start, uint32_t length)
+{
+	struct erase_info_user erase = { .start = start, .length = length };
+
+	return ioctl(f->fd, MEMERASE, &erase);
+}
+
+const struct flash_ops flash_mtd_ops = {
+	.name = "mtd",
+	.bringup = 1,
+	.open = mtd_open,
+	.region = mtd_region,
+	.erase = mtd_erase,
+	.read = fd_read,
+	.program = fd_program,
+};
+
+/*
+ * Block device, e.g. an SD card partition holding the image. Blocks are
+ * rewritten in place, so there is nothing to erase and no bit can only
+ * be cleared: blank checks and erase-free programming never apply.
+ */
+
+static int block_open(struct flash *f, const char *options)
+{
+	uint64_t size;
+	int sector;
+
+	if (parse_options(f, options) < 0)
+		return -1;
+
+	f->fd = open(f->device, O_SYNC | O_RDWR | O_CLOEXEC);
+	if (f->fd < 0)
+		return -1;
+	if (ioctl(f->fd, BLKGETSIZE64, &size) < 0 ||
+	    ioctl(f->fd, BLKSSZGET, &sector) < 0)
+		return -1;
+
+	if (f->info.erasesize % sector) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the MTD geometry is 32 bit */
+	if (size > UINT32_MAX)
+		size = UINT32_MAX;
+	f->info.type = MTD_RAM;
+	f->info.flags = MTD_WRITEABLE;
+	f->info.size = size - size % f->info.erasesize;
+	f->info.writesize = sector;
+	f->direct = 1;
+	return 0;
+}
+
+static int block_erase(struct flash *f, uint32_t start, uint32_t length)
+{
+	return check_range(f, start, length);
+}
+
+const struct flash_ops flash_block_ops = {
+	.name = "block",
+	.open = block_open,
+	.erase = block_erase,
+	.read = fd_read,
+	.program = fd_program,
+};
+
+/*
+ * NOR flash simulated in a regular file: erasing sets whole blocks to
+ * 0xff, programming can only clear bits, and every operation can be made
+ * to take as long as on a real part.
+ */
+
+static void sim_delay(unsigned long long us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = us % 1000000 * 1000,
+	};
+
+	while (us && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Number of erase blocks in [@start, @end), which must both be on block
+ * boundaries of the regions they fall in; -1 if they are not.
+ */
+static long sim_blocks(const struct flash *f, uint64_t start, uint64_t end)
+{
+	const struct region_info_user *r;
+	uint64_t s, e, rend;
+	long blocks = 0;
+	int i;
+
+	if (!f->nr_regions) {
+		if (start % f->info.erasesize || end % f->info.erasesize)
+			return -1;
+		return (end - start) / f->info.erasesize;
+	}
+
+	for (i = 0; i < f->nr_regions; i++) {
+		r = &f->regions[i];
+		rend = r->offset + (uint64_t)r->erasesize * r->numblocks;
+		s = start > r->offset ? start : r->offset;
+		e = end < rend ? end : rend;
+		if (s >= e)
+			continue;
+		if ((s - r->offset) % r->erasesize ||
+		    (e - r->offset) % r->erasesize)
+			return -1;
+		blocks += (e - s) / r->erasesize;
+	}
+
+	return blocks;
+}
+
+static int sim_open(struct flash *f, const char *options)
+{
+	const struct region_info_user *last;
+	struct stat st;
+
+	if (parse_options(f, options) < 0)
+		return -1;
+
+	f->fd = open(f->device, O_RDWR | O_CLOEXEC);
+	if (f->fd < 0 || fstat(f->fd, &st) < 0)
+		return -1;
+
+	/* with regions, the file holds exactly all of them */
+	last = f->nr_regions ? &f->regions[f->nr_regions - 1] : NULL;
+	if (st.st_size > UINT32_MAX ||
+	    (last ? st.st_size != last->offset +
+				  (off_t)last->erasesize * last->numblocks :
+		    st.st_size % f->info.erasesize)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f->info.type = MTD_NORFLASH;
+	f->info.flags = MTD_CAP_NORFLASH;
+	f->info.size = st.st_size;
+	f->info.writesize = 1;
+	return 0;
+}
+
+static int sim_region(struct flash *f, int index, struct region_info_user *r)
+{
+	if (index < 0 || index >= f->nr_regions) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*r = f->regions[index];
+	return 0;
+}
+
+static int sim_erase(struct flash *f, uint32_t start, uint32_t length)
+{
+	uint8_t *blank;
+	ssize_t ret;
+	long blocks;
+
+	blocks = sim_blocks(f, start, (uint64_t)start + length);
+	if (check_range(f, start, length) < 0 || blocks < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	blank = malloc(length);
+	if (!blank)
+		return -1;
+	memset(blank, 0xff, length);
+	ret = pwrite(f->fd, blank, length, start);
+	free(blank);
+
+	sim_delay((unsigned long long)f->erase_us * blocks);
+	return ret == (ssize_t)length ? 0 : -1;
+}
+
+static ssize_t sim_read(struct flash *f, void *buf, size_t count, off_t off)
+{
+	sim_delay(f->read_us);
+	return pread(f->fd, buf, count, off);
+}
+
+static ssize_t sim_program(struct flash *f, const void *buf, size_t count,
+			   off_t off)
+{
+	const uint8_t *src = buf;
+	uint8_t *cells;
+	ssize_t i, ret;
+
+	if (check_range(f, off, count) < 0)
+		return -1;
+
+	cells = malloc(count);
+	if (!cells)
+		return -1;
+
+	ret = pread(f->fd, cells, count, off);
+	if (ret > 0) {
+		for (i = 0; i < ret; i++)
+			cells[i] &= src[i];
+		ret = pwrite(f->fd, cells, ret, off);
+	}
+	free(cells);
+
+	/* every page touched costs one program operation */
+	sim_delay((unsigned long long)f->program_us *
+		  ((off + count + f->page - 1) / f->page - off / f->page));
+	return ret;
+}
+
+const struct flash_ops flash_sim_ops = {
+	.name = "sim",
+	.open = sim_open,
+	.region = sim_region,
+	.erase = sim_erase,
+	.read = sim_read,
+	.program = sim_program,
+};
+
+static const struct flash_ops *const backends[] = {
+	&flash_mtd_ops,
+	&flash_block_ops,
+	&flash_sim_ops,
+};
+
+/**
+ * @brief Pick the backend for @p device.
+ *
+ * @param spec "NAME[:OPTIONS]", or NULL to go by the type of @p device: a
+ * block device or a regular file (the simulator), else MTD.
+ * @return the backend, NULL if @p spec names none.
+ */
+const struct flash_ops *flash_backend(const char *spec, const char *device)
+{
+	struct stat st;
+	size_t len;
+	unsigned int i;
+
+	if (!spec) {
+		if (stat(device, &st) < 0)
+			return &flash_mtd_ops;
+		if (S_ISBLK(st.st_mode))
+			return &flash_block_ops;
+		if (S_ISREG(st.st_mode))
+			return &flash_sim_ops;
+		return &flash_mtd_ops;
+	}
+
+	len = strcspn(spec, ":");
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		if (strlen(backends[i]->name) == len &&
+		    !strncmp(spec, backends[i]->name, len))
+			return backends[i];
+
+	return NULL;
+}
+
+/**
+ * @brief Open @p device through the backend chosen by @p spec, see
+ * flash_backend(). Exits on failure.
+ */
+void flash_open(struct flash *f, const char *spec, const char *device)
+{
+	const char *options = spec && strchr(spec, ':') ?
+				      strchr(spec, ':') + 1 : "";
+
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+	f->device = device;
+	f->ops = flash_backend(spec, device);
+	if (!f->ops)
+		log_failure("Unknown flash backend %s\n", spec);
+
+	if (f->ops->open(f, options) < 0)
+		log_failure("While opening %s as %s flash: %m\n", device,
+			    f->ops->name);
+	if (!f->info.erasesize || !f->info.size)
+		log_failure("%s reports no erase blocks\n", device);
+}
+
+void flash_close(struct flash *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+	free(f->regions);
+	f->regions = NULL;
+	f->nr_regions = 0;
+}
+
+/*
+ * Decide whether to try again after attempt @attempt at an operation on
+ * @off..@off + @len failed with @err, and wait a little if so. I/O errors
+ * and timeouts of the SPI transfer often go away on a second try; bad
+ * arguments and a read-only device do not.
+ */
+static int flash_retry(struct flash *f, int attempt, int err,
+		       const char *what, uint64_t off, uint64_t len)
+{
+	if (attempt >= FLASH_RETRIES ||
+	    (err != EIO && err != ETIMEDOUT && err != EAGAIN && err != EBUSY &&
+	     err != EINTR))
+		return 0;
+
+	log_verbose("\nRetrying %s 0x%.8llx-0x%.8llx on %s (%d/%d): %s\n",
+		    what, (unsigned long long)off,
+		    (unsigned long long)(off + len), f->device, attempt,
+		    FLASH_RETRIES - 1, strerror(err));
+	if (err != EINTR)
+		usleep((FLASH_RETRY_DELAY_MS * 1000) << (attempt - 1));
+	return 1;
+}
+
+/**
+ * @brief Erase like flash_erase(), but return -1 with errno set once the
+ * retries are used up instead of exiting, for the background threads.
+ */
+int flash_try_erase(struct flash *f, uint32_t start, uint32_t length)
+{
+	uint64_t begin = stats_start();
+	int attempt, ret;
+
+	for (attempt = 1; (ret = f->ops->erase(f, start, length)) < 0;
+	     attempt++)
+		if (!flash_retry(f, attempt, errno, "erasing", start, length))
+			return ret;
+	stats_op(length, begin, attempt);
+	return 0;
+}
+
+/**
+ * @brief Read like flash_read(), without exiting.
+ *
+ * @return @p count on success, else what the last attempt returned, with
+ * errno set (EIO for a short count).
+ */
+ssize_t flash_try_read(struct flash *f, void *buf, size_t count, off_t off)
+{
+	uint64_t begin = stats_start();
+	ssize_t result;
+	int attempt;
+
+	for (attempt = 1;; attempt++) {
+		result = f->ops->read(f, buf, count, off);
+		if ((ssize_t)count == result)
+			break;
+		/* a short count is as good as an I/O error */
+		if (result >= 0)
+			errno = EIO;
+		if (!flash_retry(f, attempt, errno, "reading", off, count))
+			return result;
+	}
+	stats_op(count, begin, attempt);
+	return result;
+}
+
+void flash_erase(struct flash *f, uint32_t start, uint32_t length)
+{
+	if (flash_try_erase(f, start, length) == 0)
+		return;
+
+	log_verbose("\n");
+	log_failure("While erasing blocks 0x%.8x-0x%.8x on %s: %m\n", start,
+		    start + length, f->device);
+}
+
+void flash_read(struct flash *f, void *buf, size_t count, off_t off)
+{
+	ssize_t result = flash_try_read(f, buf, count, off);
+
+	if ((ssize_t)count == result)
+		return;
+
+	log_verbose("\n");
+	if (result < 0)
+		log_failure("While reading data from %s: %m\n", f->device);
+	log_failure("Short read count returned while reading from %s\n",
+		    f->device);
+}
+
+void flash_program(struct flash *f, const void *buf, size_t count, off_t off)
+{
+	uint64_t begin = stats_start();
+	ssize_t result;
+	int attempt;
+
+	/* programming the same data again only clears bits already clear */
+	for (attempt = 1;; attempt++) {
+		result = f->ops->program(f, buf, count, off);
+		if ((ssize_t)count == result)
+			break;
+		if (flash_retry(f, attempt, result < 0 ? errno : EIO,
+				"writing", off, count))
+			continue;
+
+		log_verbose("\n");
+		if (result < 0)
+			log_failure(
+				"While writing data to 0x%.8llx-0x%.8llx on %s: %m\n",
+				(unsigned long long)off,
+				(unsigned long long)off + count, f->device);
+		log_failure(
+			"Short write count returned while writing to 0x%.8llx-0x%.8llx on %s\n",
+			(unsigned long long)off,
+			(unsigned long long)off + count, f->device);
+	}
+	stats_op(count, begin, attempt);
+}
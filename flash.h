@@ -0,0 +1,62 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <mtd/mtd-user.h>
+
+/* attempts at an operation that fails with a transient error */
+#define FLASH_RETRIES 3
+
+struct flash;
+
+/*
+ * A flash backend. Operations return 0, or the bytes moved for read and
+ * program, and -1 with errno set on failure.
+ */
+struct flash_ops {
+	const char *name;
+	/* the device only appears once the SPI flash has been brought up */
+	int bringup;
+
+	int (*open)(struct flash *f, const char *options);
+	/* erase region @index, for backends that set nr_regions */
+	int (*region)(struct flash *f, int index, struct region_info_user *r);
+	int (*erase)(struct flash *f, uint32_t start, uint32_t length);
+	ssize_t (*read)(struct flash *f, void *buf, size_t count, off_t off);
+	ssize_t (*program)(struct flash *f, const void *buf, size_t count,
+			   off_t off);
+};
+
+struct flash {
+	const struct flash_ops *ops;
+	const char *device;
+	int fd;
+	struct mtd_info_user info;
+	int nr_regions;
+
+	/* reads and writes of fd reach the flash as is, e.g. from io_uring */
+	int direct;
+
+	/* simulator latencies in microseconds, and its program page size */
+	unsigned int erase_us, program_us, read_us;
+	uint32_t page;
+	/* simulator erase regions, see its "regions" option */
+	struct region_info_user *regions;
+};
+
+extern const struct flash_ops flash_mtd_ops;
+extern const struct flash_ops flash_block_ops;
+extern const struct flash_ops flash_sim_ops;
+
+const struct flash_ops *flash_backend(const char *spec, const char *device);
+void flash_open(struct flash *f, const char *spec, const char *device);
+void flash_close(struct flash *f);
+int flash_try_erase(struct flash *f, uint32_t start, uint32_t length);
+ssize_t flash_try_read(struct flash *f, void *buf, size_t count, off_t off);
+void flash_erase(struct flash *f, uint32_t start, uint32_t length);
+void flash_read(struct flash *f, void *buf, size_t count, off_t off);
+void flash_program(struct flash *f, const void *buf, size_t count, off_t off);
+
+#endif /* FLASH_H */
@@ -3,13 +3,59 @@
  */
 
 #include "flashcp.h"
+#include "gpiocdev.h"
 #include <stdio.h>
+#include <time.h>
+
+/*
+ * set when the output is relayed line by line, as for the workers of
+ * several targets, whose lines the parent tags with their device
+ */
+static int log_lines;
+static time_t log_progress_time;
+
+void set_log_lines(int lines)
+{
+	log_lines = lines;
+}
+
+/*
+ * Print a message as a whole line. "\r" progress updates would garble
+ * the relayed output, so they become lines too, at most one a second
+ * apart unless they finish the line.
+ */
+static void log_line(FILE *stream, const char *fmt, va_list ap)
+{
+	char buf[512], *msg = buf;
+	size_t len;
+	int progress;
+	time_t now;
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	progress = *msg == '\r';
+	msg += strspn(msg, "\r\n");
+	len = strlen(msg);
+	if (!len)
+		return;
+
+	if (progress && msg[len - 1] != '\n') {
+		now = time(NULL);
+		if (now == log_progress_time)
+			return;
+		log_progress_time = now;
+	}
+
+	fprintf(stream, "%s%s", msg, msg[len - 1] == '\n' ? "" : "\n");
+}
 
 NORETURN void log_failure(const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	if (log_lines)
+		log_line(stderr, fmt, ap);
+	else
+		vfprintf(stderr, fmt, ap);
 	va_end(ap);
 	fflush(stderr);
 
@@ -20,8 +66,7 @@ static int verbose = 0;
 
 void set_verbose(int v)
 {
-	if (v)
-		verbose = 1;
+	verbose = v ? 1 : 0;
 }
 
 int get_verbose(void)
@@ -37,7 +82,10 @@ void log_verbose(const char *fmt, ...)
 		return;
 
 	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
+	if (log_lines)
+		log_line(stdout, fmt, ap);
+	else
+		vfprintf(stdout, fmt, ap);
 	va_end(ap);
 	fflush(stdout);
 }
@@ -66,70 +114,72 @@ int safe_open(const char *pathname, int flags)
 	return (fd);
 }
 
-void safe_read(int fd, const char *filename, void *buf, size_t count)
+/**
+ * @brief Check whether a buffer reads back as erased NOR flash (all 0xff).
+ *
+ * Works on 64 bit words and ANDs a whole stride together before testing,
+ * so the compiler can turn the inner loop into vector instructions.
+ *
+ * @return 1 if every byte is 0xff, 0 otherwise.
+ */
+int is_erased(const void *buf, size_t count)
 {
-	ssize_t result;
-
-	result = read(fd, buf, count);
-	if ((ssize_t)count != result) {
-		log_verbose("\n");
-		if (result < 0) {
-			log_failure("While reading data from %s: %m\n",
-				    filename);
+	const unsigned char *p = buf;
+	uint64_t acc, w;
+	size_t i;
+
+	while (count >= 256) {
+		acc = ~0ULL;
+		for (i = 0; i < 256; i += sizeof(w)) {
+			memcpy(&w, p + i, sizeof(w));
+			acc &= w;
 		}
-		log_failure("Short read count returned while reading from %s\n",
-			    filename);
+		if (acc != ~0ULL)
+			return 0;
+		p += 256;
+		count -= 256;
 	}
-}
 
-void safe_write(int fd, const void *buf, size_t count, size_t written,
-		       unsigned long long to_write, const char *device)
-{
-	ssize_t result;
-
-	/* write to device */
-	result = write(fd, buf, count);
-	if ((ssize_t)count != result) {
-		log_verbose("\n");
-		if (result < 0) {
-			log_failure(
-				"While writing data to 0x%.8lx-0x%.8lx on %s: %m\n",
-				written, written + count, device);
-		}
-		log_failure(
-			"Short write count returned while writing to x%.8zx-0x%.8zx on %s: %zu/%llu bytes written to flash\n",
-			written, written + count, device, written + result,
-			to_write);
-	}
+	while (count--)
+		if (*p++ != 0xff)
+			return 0;
+
+	return 1;
 }
 
-off_t safe_lseek(int fd, off_t offset, int whence, const char *filename)
+/**
+ * @brief Check whether @p new can be programmed over @p old without an erase.
+ *
+ * NOR flash programming can only clear bits, so this holds when every bit
+ * set in @p new is also set in @p old, i.e. (old & new) == new.
+ *
+ * @return 1 if no erase is needed, 0 otherwise.
+ */
+int is_programmable(const void *old, const void *new, size_t count)
 {
-	off_t off;
-
-	off = lseek(fd, offset, whence);
-	if (off < 0) {
-		log_failure("While seeking on %s: %m\n", filename);
+	const unsigned char *o = old, *n = new;
+	uint64_t acc, wo, wn;
+	size_t i;
+
+	while (count >= 256) {
+		acc = 0;
+		for (i = 0; i < 256; i += sizeof(wo)) {
+			memcpy(&wo, o + i, sizeof(wo));
+			memcpy(&wn, n + i, sizeof(wn));
+			acc |= wn & ~wo;
+		}
+		if (acc)
+			return 0;
+		o += 256;
+		n += 256;
+		count -= 256;
 	}
 
-	return off;
-}
+	while (count--)
+		if (*n++ & ~*o++)
+			return 0;
 
-void safe_rewind(int fd, const char *filename)
-{
-	safe_lseek(fd, 0L, SEEK_SET, filename);
-}
-
-void safe_memerase(int fd, const char *device,
-			  struct erase_info_user *erase)
-{
-	if (ioctl(fd, MEMERASE, erase) < 0) {
-		log_verbose("\n");
-		log_failure("While erasing blocks 0x%.8x-0x%.8x on %s: %m\n",
-			    (unsigned int)erase->start,
-			    (unsigned int)(erase->start + erase->length),
-			    device);
-	}
+	return 1;
 }
 
 int gpio_export(const char *pin)
@@ -273,14 +323,21 @@ free_gpio:
 	free(gpio_value);
 }
 
+/* both lines at once through the chardev, one by one through sysfs */
 void flash_access_to_processor(void)
 {
+	if (gpiocdev_set(0, 0) == 0)
+		return;
+
 	gpio_set_value(RESET_GPIO, "0");
 	gpio_set_value(CONDONE_GPIO, "0");
 }
 
 void flash_access_to_fpga(void)
 {
+	if (gpiocdev_set(1, 1) == 0)
+		return;
+
 	gpio_set_value(RESET_GPIO, "1");
 	gpio_set_value(CONDONE_GPIO, "1");
 }
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <mtd/mtd-user.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,19 +29,13 @@
 #define CONDONE_GPIO "510"
 
 void set_verbose(int v);
+void set_log_lines(int lines);
 int get_verbose(void);
 NORETURN void log_failure(const char *fmt, ...);
 void log_verbose(const char *fmt, ...);
 int safe_open(const char *pathname, int flags);
-void safe_read(int fd, const char *filename, void *buf, size_t count);
-void safe_write(int fd, const void *buf, size_t count, size_t written,
-		       unsigned long long to_write, const char *device);
-off_t safe_lseek(int fd, off_t offset, int whence, const char *filename);
-
-void safe_rewind(int fd, const char *filename);
-
-void safe_memerase(int fd, const char *device,
-			  struct erase_info_user *erase);
+int is_erased(const void *buf, size_t count);
+int is_programmable(const void *old, const void *new, size_t count);
 
 int gpio_export(const char *pin);
 int gpio_unexport(const char *pin);
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * RESET and CONDONE through the GPIO character device (v2 uAPI). Both
+ * lines are requested once, on first use, and held until exit, and every
+ * change sets them together with a single ioctl. Callers fall back to the
+ * sysfs interface when this fails.
+ */
+
+#include "flashcp.h"
+#include "gpiocdev.h"
+#include <dirent.h>
+#include <limits.h>
+#include <linux/gpio.h>
+
+/* /dev/gpiochipN and the line offsets of RESET and CONDONE on it */
+static char chip[64];
+static unsigned int offsets[2];
+static int configured;
+
+/* request fd holding both lines, -1 until requested, -2 if unusable */
+static int line_fd = -1;
+
+static int read_uint(const char *path, unsigned int *val)
+{
+	FILE *fp = fopen(path, "r");
+	int ret;
+
+	if (!fp)
+		return -1;
+	ret = fscanf(fp, "%u", val) == 1 ? 0 : -1;
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Find the chip and offset of global GPIO number @gpio from the sysfs
+ * chip ranges, /sys/class/gpio/gpiochip<base>/{base,ngpio}.
+ */
+static int find_line(unsigned int gpio, char *name, size_t len,
+		     unsigned int *offset)
+{
+	char path[PATH_MAX];
+	unsigned int base, ngpio;
+	struct dirent *de, *dev;
+	DIR *dir, *devdir;
+	int ret = -1;
+
+	dir = opendir("/sys/class/gpio");
+	if (!dir)
+		return -1;
+
+	while (ret && (de = readdir(dir))) {
+		if (strncmp(de->d_name, "gpiochip", 8))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/gpio/%s/base",
+			 de->d_name);
+		if (read_uint(path, &base) < 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/gpio/%s/ngpio",
+			 de->d_name);
+		if (read_uint(path, &ngpio) < 0 || gpio < base ||
+		    gpio >= base + ngpio)
+			continue;
+
+		/* the chardev's name is a directory of the parent device */
+		snprintf(path, sizeof(path), "/sys/class/gpio/%s/device",
+			 de->d_name);
+		devdir = opendir(path);
+		if (!devdir)
+			continue;
+		while ((dev = readdir(devdir))) {
+			if (!strncmp(dev->d_name, "gpiochip", 8)) {
+				snprintf(name, len, "/dev/%.32s", dev->d_name);
+				*offset = gpio - base;
+				ret = 0;
+				break;
+			}
+		}
+		closedir(devdir);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * @brief Choose the lines to drive.
+ *
+ * Without this, RESET_GPIO and CONDONE_GPIO are looked up in the sysfs
+ * chip ranges on first use.
+ *
+ * @param spec "CHIP:RESET,CONDONE", e.g. "gpiochip3:5,6".
+ * @return 0 on success, -1 if @p spec is malformed.
+ */
+int gpiocdev_configure(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len;
+
+	if (!colon || colon == spec ||
+	    sscanf(colon + 1, "%u,%u", &offsets[0], &offsets[1]) != 2)
+		return -1;
+
+	len = colon - spec;
+	if (spec[0] == '/')
+		snprintf(chip, sizeof(chip), "%.*s", (int)len, spec);
+	else
+		snprintf(chip, sizeof(chip), "/dev/%.*s", (int)len, spec);
+
+	configured = 1;
+	return 0;
+}
+
+/* Request both lines as outputs, starting at the values wanted now */
+static int request_lines(uint64_t values)
+{
+	struct gpio_v2_line_request req;
+	char other[64];
+	unsigned int offset;
+	int fd;
+
+	if (!configured) {
+		if (find_line(atoi(RESET_GPIO), chip, sizeof(chip),
+			      &offsets[0]) < 0 ||
+		    find_line(atoi(CONDONE_GPIO), other, sizeof(other),
+			      &offset) < 0)
+			return -1;
+		/* a single ioctl can only set lines of one chip */
+		if (strcmp(chip, other))
+			return -1;
+		offsets[1] = offset;
+	}
+
+	fd = open(chip, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = offsets[0];
+	req.offsets[1] = offsets[1];
+	req.num_lines = 2;
+	strcpy(req.consumer, PROGRAM_NAME);
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	req.config.num_attrs = 1;
+	req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	req.config.attrs[0].attr.values = values;
+	req.config.attrs[0].mask = 3;
+
+	if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		log_verbose("Failed to request lines %u,%u of %s: %m\n",
+			    offsets[0], offsets[1], chip);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	line_fd = req.fd;
+	return 0;
+}
+
+/**
+ * @brief Drive RESET and CONDONE to the given levels at the same time.
+ *
+ * @return 0 on success, -1 if the character device cannot be used.
+ */
+int gpiocdev_set(int reset, int condone)
+{
+	struct gpio_v2_line_values lv = {
+		.bits = (reset ? 1 : 0) | (condone ? 2 : 0),
+		.mask = 3,
+	};
+
+	if (line_fd == -2)
+		return -1;
+
+	if (line_fd < 0) {
+		if (request_lines(lv.bits) < 0) {
+			line_fd = -2;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (ioctl(line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &lv) < 0) {
+		log_verbose("Failed to set lines %u,%u of %s: %m\n",
+			    offsets[0], offsets[1], chip);
+		return -1;
+	}
+
+	return 0;
+}
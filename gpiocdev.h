@@ -0,0 +1,7 @@
+#ifndef GPIOCDEV_H
+#define GPIOCDEV_H
+
+int gpiocdev_configure(const char *spec);
+int gpiocdev_set(int reset, int condone);
+
+#endif /* GPIOCDEV_H */
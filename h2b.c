@@ -3,85 +3,1029 @@
  * Written by djkabutar <d.kabutarwala@yahoo.com>
  * All rights reserved.
  */
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int convert_to_bin(const char *inp, const char *out)
+#include "h2b.h"
+#include "decompress.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H2B_HAVE_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define H2B_HAVE_NEON 1
+#endif
+
+/* number of records decoded per read() of the input */
+#define H2B_CHUNK_LINES 16384
+
+/* smallest share of a mapped file worth handing to another thread */
+#define H2B_THREAD_MIN_LINES (256 * 1024)
+
+typedef long (*h2b_kernel_fn)(const char *src, size_t lines, uint8_t *dst);
+
+/* nibble value + 1 of every hex digit, 0 for anything else */
+static const uint8_t hex_nibble[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/**
+ * @brief Decode whole "XX\n" records into bytes, one record at a time.
+ *
+ * @param src   Input text, @p lines * H2B_LINE_LEN bytes long.
+ * @param lines Number of records in @p src.
+ * @param dst   Output buffer, at least @p lines bytes long.
+ * @return -1 on success, otherwise the index of the first malformed record.
+ */
+static long decode_scalar(const char *src, size_t lines, uint8_t *dst)
+{
+	size_t i;
+
+	for (i = 0; i < lines; i++, src += H2B_LINE_LEN) {
+		int hi = hex_nibble[(unsigned char)src[0]];
+		int lo = hex_nibble[(unsigned char)src[1]];
+
+		if (!hi || !lo || src[2] != '\n')
+			return i;
+		dst[i] = (uint8_t)((hi - 1) << 4 | (lo - 1));
+	}
+
+	return -1;
+}
+
+/*
+ * The vector kernels below decode a fixed number of records per step and
+ * only check whether the whole step was valid. When it was not, the step
+ * is handed to decode_scalar() to locate the exact bad record.
+ */
+static long decode_tail(const char *src, size_t done, size_t lines,
+			uint8_t *dst)
+{
+	long bad = decode_scalar(src + done * H2B_LINE_LEN, lines - done,
+				 dst + done);
+
+	return bad < 0 ? -1 : (long)done + bad;
+}
+
+#if defined(__SSE2__)
+/* nibble value of each byte of @c, and 0xff in @valid for hex digits */
+static inline __m128i hex_value_sse2(__m128i c, __m128i *valid)
+{
+	const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	const __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+				       _mm_set1_epi8('a'));
+	const __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	const __m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+
+	*valid = _mm_or_si128(is_d, is_l);
+	return _mm_or_si128(_mm_and_si128(is_d, d),
+			    _mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+/*
+ * 16 records (48 bytes) per step. SSE2 has no byte shuffle, so every input
+ * byte is decoded in place, each digit is merged with its right neighbour
+ * and every third byte is picked out of the result.
+ */
+static long decode_sse2(const char *src, size_t lines, uint8_t *dst)
+{
+	/* 0xff where a '\n' is expected in each of the three vectors */
+	const __m128i nl_mask[3] = {
+		_mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0),
+		_mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0),
+		_mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1),
+	};
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint8_t tmp[48] __attribute__((aligned(16)));
+	size_t i, j;
+	int k;
+
+	for (i = 0; i + 16 <= lines; i += 16) {
+		const char *p = src + i * H2B_LINE_LEN;
+		__m128i c[3], n[3], ok, valid;
+		uint64_t lo = 0, hi = 0;
+
+		ok = _mm_set1_epi8(-1);
+		for (k = 0; k < 3; k++) {
+			c[k] = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+			n[k] = hex_value_sse2(c[k], &valid);
+			valid = _mm_or_si128(
+				_mm_and_si128(nl_mask[k], _mm_cmpeq_epi8(c[k], nl)),
+				_mm_andnot_si128(nl_mask[k], valid));
+			ok = _mm_and_si128(ok, valid);
+		}
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			return decode_tail(src, i, lines, dst);
+
+		_mm_store_si128((__m128i *)tmp,
+				_mm_or_si128(_mm_slli_epi16(n[0], 4),
+					     _mm_or_si128(_mm_srli_si128(n[0], 1),
+							  _mm_slli_si128(n[1], 15))));
+		_mm_store_si128((__m128i *)(tmp + 16),
+				_mm_or_si128(_mm_slli_epi16(n[1], 4),
+					     _mm_or_si128(_mm_srli_si128(n[1], 1),
+							  _mm_slli_si128(n[2], 15))));
+		_mm_store_si128((__m128i *)(tmp + 32),
+				_mm_or_si128(_mm_slli_epi16(n[2], 4),
+					     _mm_srli_si128(n[2], 1)));
+
+		for (j = 0; j < 8; j++) {
+			lo |= (uint64_t)tmp[j * H2B_LINE_LEN] << (8 * j);
+			hi |= (uint64_t)tmp[(j + 8) * H2B_LINE_LEN] << (8 * j);
+		}
+		memcpy(dst + i, &lo, 8);
+		memcpy(dst + i + 8, &hi, 8);
+	}
+
+	return decode_tail(src, i, lines, dst);
+}
+#endif
+
+#if defined(H2B_HAVE_X86)
+/*
+ * pshufb masks gathering field f (0: high digit, 1: low digit, 2: newline)
+ * of 16 records out of the k-th 16 byte slice of their 48 input bytes.
+ */
+static uint8_t avx2_gather[3][3][16] __attribute__((aligned(16)));
+
+static void avx2_init(void)
+{
+	int f, k, j;
+
+	for (f = 0; f < 3; f++)
+		for (k = 0; k < 3; k++)
+			for (j = 0; j < 16; j++) {
+				int pos = j * H2B_LINE_LEN + f;
+
+				avx2_gather[f][k][j] =
+					pos / 16 == k ? pos % 16 : 0x80;
+			}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gather_avx2(const __m256i c[3], int f)
+{
+	__m256i r = _mm256_setzero_si256();
+	int k;
+
+	for (k = 0; k < 3; k++)
+		r = _mm256_or_si256(r, _mm256_shuffle_epi8(c[k],
+			_mm256_broadcastsi128_si256(_mm_load_si128(
+				(const __m128i *)avx2_gather[f][k]))));
+
+	return r;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hex_value_avx2(__m256i c, __m256i *valid)
+{
+	const __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	const __m256i l = _mm256_sub_epi8(
+		_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	const __m256i is_d = _mm256_cmpeq_epi8(
+		_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	const __m256i is_l = _mm256_cmpeq_epi8(
+		_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+
+	*valid = _mm256_or_si256(is_d, is_l);
+	return _mm256_or_si256(_mm256_and_si256(is_d, d),
+			       _mm256_and_si256(is_l,
+				       _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+/*
+ * 32 records (96 bytes) per step. Each 128 bit lane works on 16 records,
+ * so the loads are arranged to keep every record inside a single lane.
+ */
+__attribute__((target("avx2")))
+static long decode_avx2(const char *src, size_t lines, uint8_t *dst)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i + 32 <= lines; i += 32) {
+		const char *p = src + i * H2B_LINE_LEN;
+		__m256i c[3], hi, lo, nl, vhi, vlo, ok;
+
+		for (k = 0; k < 3; k++)
+			c[k] = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128(
+					(const __m128i *)(p + 16 * k))),
+				_mm_loadu_si128((const __m128i *)(p + 48 + 16 * k)),
+				1);
+
+		hi = hex_value_avx2(gather_avx2(c, 0), &vhi);
+		lo = hex_value_avx2(gather_avx2(c, 1), &vlo);
+		nl = _mm256_cmpeq_epi8(gather_avx2(c, 2),
+				       _mm256_set1_epi8('\n'));
+
+		ok = _mm256_and_si256(_mm256_and_si256(vhi, vlo), nl);
+		if (_mm256_movemask_epi8(ok) != -1)
+			return decode_tail(src, i, lines, dst);
+
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_or_si256(_mm256_slli_epi16(hi, 4), lo));
+	}
+
+	return decode_tail(src, i, lines, dst);
+}
+#endif
+
+#if defined(H2B_HAVE_NEON)
+static inline uint8x16_t hex_value_neon(uint8x16_t c, uint8x16_t *valid)
+{
+	const uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+	const uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)),
+				      vdupq_n_u8('a'));
+	const uint8x16_t is_d = vcltq_u8(d, vdupq_n_u8(10));
+
+	*valid = vorrq_u8(is_d, vcltq_u8(l, vdupq_n_u8(6)));
+	return vbslq_u8(is_d, d, vaddq_u8(l, vdupq_n_u8(10)));
+}
+
+/* 16 records (48 bytes) per step, de-interleaved by vld3q */
+static long decode_neon(const char *src, size_t lines, uint8_t *dst)
+{
+	size_t i;
+
+	for (i = 0; i < lines - lines % 16; i += 16) {
+		uint8x16x3_t c = vld3q_u8((const uint8_t *)src +
+					  i * H2B_LINE_LEN);
+		uint8x16_t hi, lo, vhi, vlo, ok;
+		uint64x2_t all;
+
+		hi = hex_value_neon(c.val[0], &vhi);
+		lo = hex_value_neon(c.val[1], &vlo);
+		ok = vandq_u8(vandq_u8(vhi, vlo),
+			      vceqq_u8(c.val[2], vdupq_n_u8('\n')));
+
+		all = vreinterpretq_u64_u8(ok);
+		if ((vgetq_lane_u64(all, 0) & vgetq_lane_u64(all, 1)) != ~0ULL)
+			return decode_tail(src, i, lines, dst);
+
+		vst1q_u8(dst + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+	}
+
+	return decode_tail(src, i, lines, dst);
+}
+#endif
+
+static const struct {
+	const char *name;
+	h2b_kernel_fn fn;
+} h2b_kernels[] = {
+#if defined(H2B_HAVE_X86)
+	{ "avx2", decode_avx2 },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", decode_sse2 },
+#endif
+#if defined(H2B_HAVE_NEON)
+	{ "neon", decode_neon },
+#endif
+	{ "scalar", decode_scalar },
+};
+
+#define H2B_NR_KERNELS (sizeof(h2b_kernels) / sizeof(h2b_kernels[0]))
+
+static int h2b_kernel = -1;
+
+static int kernel_supported(size_t k)
+{
+#if defined(H2B_HAVE_X86)
+	if (h2b_kernels[k].fn == decode_avx2) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return 0;
+		avx2_init();
+	}
+#endif
+	(void)k;
+	return 1;
+}
+
+static void h2b_select_kernel(void)
+{
+	size_t k;
+
+	/* kernels are listed fastest first, scalar always works */
+	for (k = 0; k < H2B_NR_KERNELS; k++)
+		if (kernel_supported(k))
+			break;
+	h2b_kernel = k;
+}
+
+int h2b_set_kernel(const char *name)
+{
+	size_t k;
+
+	for (k = 0; k < H2B_NR_KERNELS; k++) {
+		if (strcmp(h2b_kernels[k].name, name))
+			continue;
+		if (!kernel_supported(k))
+			return -1;
+		h2b_kernel = k;
+		return 0;
+	}
+
+	return -1;
+}
+
+const char *h2b_kernel_name(void)
+{
+	if (h2b_kernel < 0)
+		h2b_select_kernel();
+
+	return h2b_kernels[h2b_kernel].name;
+}
+
+long h2b_decode(const char *src, size_t lines, uint8_t *dst)
+{
+	if (h2b_kernel < 0)
+		h2b_select_kernel();
+
+	return h2b_kernels[h2b_kernel].fn(src, lines, dst);
+}
+
+/* where convert_stream() puts decoded bytes, @len bytes long so far */
+struct h2b_sink {
+	uint8_t *buf;
+	size_t len, cap;
+};
+
+struct decode_job {
+	pthread_t thread;
+	const char *src;
+	uint8_t *dst;
+	size_t lines;
+	long bad;
+};
+
+static void *decode_worker(void *arg)
+{
+	struct decode_job *job = arg;
+
+	job->bad = h2b_decode(job->src, job->lines, job->dst);
+	return NULL;
+}
+
+/**
+ * @brief Decode records split into line aligned chunks across all CPUs.
+ *
+ * Every record is H2B_LINE_LEN bytes, so the output offset of each chunk
+ * is known up front and the workers write straight into @p dst.
+ *
+ * @return -1 on success, otherwise the index of the first malformed record.
+ */
+static long decode_parallel(const char *src, size_t lines, uint8_t *dst)
+{
+	struct decode_job *jobs;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nr_jobs, per_job, i, started;
+	long bad = -1;
+
+	nr_jobs = lines / H2B_THREAD_MIN_LINES;
+	if (cpus > 0 && nr_jobs > (size_t)cpus)
+		nr_jobs = cpus;
+	if (nr_jobs <= 1)
+		return h2b_decode(src, lines, dst);
+
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	if (!jobs)
+		return h2b_decode(src, lines, dst);
+
+	/* resolve the kernel once, before the workers race for it */
+	h2b_kernel_name();
+
+	per_job = (lines + nr_jobs - 1) / nr_jobs;
+	for (i = 0; i < nr_jobs; i++) {
+		size_t first = i * per_job;
+
+		jobs[i].src = src + first * H2B_LINE_LEN;
+		jobs[i].dst = dst + first;
+		jobs[i].lines = first + per_job > lines ? lines - first : per_job;
+	}
+
+	/* the calling thread decodes the first chunk itself */
+	for (started = 1; started < nr_jobs; started++)
+		if (pthread_create(&jobs[started].thread, NULL, decode_worker,
+				   &jobs[started]))
+			break;
+	decode_worker(&jobs[0]);
+
+	for (i = 1; i < nr_jobs; i++) {
+		if (i < started)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			decode_worker(&jobs[i]);
+	}
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].bad >= 0) {
+			bad = i * per_job + jobs[i].bad;
+			break;
+		}
+	}
+
+	free(jobs);
+	return bad;
+}
+
+static int sink_put(struct h2b_sink *sink, const uint8_t *buf, size_t count)
+{
+	uint8_t *grown;
+	size_t cap;
+
+	if (sink->len + count > sink->cap) {
+		cap = sink->cap ? sink->cap : H2B_CHUNK_LINES;
+		while (cap < sink->len + count)
+			cap *= 2;
+		grown = realloc(sink->buf, cap);
+		if (!grown)
+			return -1;
+		sink->buf = grown;
+		sink->cap = cap;
+	}
+
+	memcpy(sink->buf + sink->len, buf, count);
+	sink->len += count;
+	return 0;
+}
+
+/*
+ * Put @count bytes at offset @addr of the sink, which may be before its
+ * end (overwriting) or past it (the gap is left erased, 0xff).
+ */
+static int sink_put_at(struct h2b_sink *sink, size_t addr, const uint8_t *buf,
+		       size_t count)
+{
+	uint8_t blank[256];
+	size_t n;
+
+	memset(blank, 0xff, sizeof(blank));
+	while (sink->len < addr) {
+		n = addr - sink->len < sizeof(blank) ? addr - sink->len :
+						       sizeof(blank);
+		if (sink_put(sink, blank, n))
+			return -1;
+	}
+
+	if (addr < sink->len) {
+		n = sink->len - addr < count ? sink->len - addr : count;
+		memcpy(sink->buf + addr, buf, n);
+		buf += n;
+		count -= n;
+	}
+
+	return sink_put(sink, buf, count);
+}
+
+/* strip one compression suffix, then look for a binary image extension */
+static int binary_name(const char *name)
+{
+	static const char *const packed[] = { ".gz", ".zst", ".lz4" };
+	const char *dot;
+	size_t len, i, n;
+
+	len = strlen(name);
+	for (i = 0; i < sizeof(packed) / sizeof(packed[0]); i++) {
+		n = strlen(packed[i]);
+		if (len > n && !strcasecmp(name + len - n, packed[i])) {
+			len -= n;
+			break;
+		}
+	}
+
+	if (len < 4)
+		return 0;
+	dot = name + len - 4;
+
+	return !strncasecmp(dot, ".bin", 4) || !strncasecmp(dot, ".bit", 4);
+}
+
+/**
+ * @brief Tell the format of an image from its first bytes, and its name
+ * where they leave it open.
+ *
+ * Clean "XX\n" records are Efinix hex, text whose first record starts
+ * with ':' is Intel HEX, and anything that is not text is a binary image,
+ * whatever the name. Other text is only taken as a binary image if it is
+ * named .bin or .bit (also compressed); otherwise it goes to the Efinix
+ * parser, which fails with the line at fault. An empty input is Efinix
+ * hex, as before formats were detected.
+ *
+ * @param name The path of the input.
+ * @param head The first bytes of the input, up to H2B_DETECT_LEN.
+ */
+enum h2b_format h2b_detect(const char *name, const uint8_t *head, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (i % H2B_LINE_LEN == H2B_LINE_LEN - 1 ?
+			    head[i] != '\n' : !hex_nibble[head[i]])
+			break;
+	if (i == len)
+		return H2B_FORMAT_EFINIX;
+
+	for (i = 0; i < len; i++)
+		if ((head[i] < ' ' || head[i] > '~') && head[i] != '\n' &&
+		    head[i] != '\r' && head[i] != '\t')
+			return H2B_FORMAT_RAW;
+
+	/* the Intel HEX parser skips blank lines */
+	for (i = 0; i < len && (head[i] == '\r' || head[i] == '\n'); i++)
+		;
+	if (i < len && head[i] == ':')
+		return H2B_FORMAT_IHEX;
+
+	return binary_name(name) ? H2B_FORMAT_RAW : H2B_FORMAT_EFINIX;
+}
+
+/* the input file, read through a decompressor if it is compressed */
+struct h2b_input {
+	int fd;
+	struct decompressor *dec;
+	enum h2b_format format;
+	/* bytes read to detect the format, handed out first */
+	uint8_t head[H2B_DETECT_LEN];
+	size_t head_len, head_pos;
+};
+
+/* read past the head, decompressing if needed */
+static ssize_t source_read(struct h2b_input *in, void *buf, size_t count)
+{
+	if (in->dec)
+		return decompress_read(in->dec, buf, count);
+
+	return read(in->fd, buf, count);
+}
+
+static ssize_t input_read(struct h2b_input *in, void *buf, size_t count)
+{
+	size_t n;
+
+	if (in->head_pos < in->head_len) {
+		n = in->head_len - in->head_pos;
+		if (n > count)
+			n = count;
+		memcpy(buf, in->head + in->head_pos, n);
+		in->head_pos += n;
+		return n;
+	}
+
+	return source_read(in, buf, count);
+}
+
+/* Fill the head from the input, short only at its end */
+static int read_head(struct h2b_input *in)
 {
-	FILE *input;
-	FILE *output;
-	char *line = NULL;
-	size_t len = 0;
 	ssize_t nread;
+
+	in->head_len = in->head_pos = 0;
+	while (in->head_len < sizeof(in->head)) {
+		nread = source_read(in, in->head + in->head_len,
+				    sizeof(in->head) - in->head_len);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (nread == 0)
+			break;
+		in->head_len += nread;
+	}
+
+	return 0;
+}
+
+static int open_input(const char *inp, struct h2b_input *in)
+{
+	enum decompress_format compression;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = open(inp, O_RDONLY);
+	if (in->fd < 0) {
+		printf("Unable to open %s\n", inp);
+		return -1;
+	}
+
+	if (read_head(in) < 0) {
+		printf("Unable to read %s\n", inp);
+		goto err;
+	}
+
+	compression = decompress_detect(in->head, in->head_len);
+	if (compression != DECOMPRESS_NONE) {
+		in->dec = decompress_open(in->fd, compression, in->head,
+					  in->head_len);
+		if (!in->dec) {
+			if (errno == ENOTSUP)
+				printf("%s is %s compressed, which this build does not support\n",
+				       inp, decompress_name(compression));
+			else
+				printf("Unable to decompress %s\n", inp);
+			goto err;
+		}
+
+		/* the format is that of the decompressed data */
+		if (read_head(in) < 0) {
+			printf("Unable to decompress %s\n", inp);
+			goto err;
+		}
+	}
+
+	in->format = h2b_detect(inp, in->head, in->head_len);
+	return 0;
+
+err:
+	decompress_close(in->dec);
+	close(in->fd);
+	return -1;
+}
+
+static void close_input(struct h2b_input *in)
+{
+	decompress_close(in->dec);
+	close(in->fd);
+}
+
+/* Efinix hex through a fixed size working buffer */
+static int stream_efinix(struct h2b_input *in, struct h2b_sink *sink,
+			 const char *inp)
+{
 	char *data;
 	uint8_t *array;
-	unsigned int i = 0;
-	unsigned int count = 0;
+	size_t pending = 0, lines;
+	unsigned long line = 0;
+	ssize_t nread;
+	long bad;
 	int ret = 0;
-	char c;
-	size_t elements_written;
-	data = malloc(sizeof(char) * 5);
-	array = malloc(sizeof(uint8_t) * 3560000);
 
-	if (!inp) {
-		printf("Specify filename!\n");
+	data = malloc(H2B_CHUNK_LINES * H2B_LINE_LEN);
+	array = malloc(H2B_CHUNK_LINES);
+	if (!data || !array) {
+		printf("Unable to allocate conversion buffers\n");
 		ret = -1;
-		goto err_input;
+		goto out;
 	}
 
-	input = fopen(inp, "r");
-	if (!input) {
-		printf("Unable to open %s\n", inp);
+	for (;;) {
+		nread = input_read(in, data + pending,
+				   H2B_CHUNK_LINES * H2B_LINE_LEN - pending);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			printf(in->dec ? "Unable to decompress %s\n" :
+					 "Unable to read %s\n", inp);
+			ret = -1;
+			goto out;
+		}
+		if (nread == 0)
+			break;
+
+		pending += nread;
+		lines = pending / H2B_LINE_LEN;
+
+		bad = h2b_decode(data, lines, array);
+		if (bad >= 0) {
+			printf("File is not properly formatted at line %lu\n",
+			       line + bad + 1);
+			ret = -1;
+			goto out;
+		}
+
+		if (sink_put(sink, array, lines)) {
+			printf("File is not properly written!\n");
+			ret = -1;
+			goto out;
+		}
+
+		line += lines;
+		/* carry a partial record over to the next read */
+		pending -= lines * H2B_LINE_LEN;
+		memmove(data, data + lines * H2B_LINE_LEN, pending);
+	}
+
+	if (pending) {
+		printf("File is not properly formatted at line %lu\n",
+		       line + 1);
 		ret = -1;
-		goto err_input;
 	}
 
-	while (!feof(input)) {
-		c = fgetc(input);
-		if (c == '\n') {
-			count++;
+out:
+	free(data);
+	free(array);
+
+	return ret;
+}
+
+/* longest Intel HEX record: count, address, type, 255 data bytes, checksum */
+#define IHEX_MAX_RECORD (1 + 2 + 1 + 255 + 1)
+
+/*
+ * Apply the Intel HEX record in @s, @len characters without the newline.
+ * Returns 0 if it is fine, -1 if it is malformed, 1 if the sink failed.
+ */
+static int ihex_record(const char *s, size_t len, struct h2b_sink *sink,
+		       size_t *base, int *end)
+{
+	uint8_t rec[IHEX_MAX_RECORD], sum = 0;
+	size_t i, n;
+	int hi, lo;
+
+	if (len && s[len - 1] == '\r')
+		len--;
+	if (!len)
+		return 0;
+
+	n = (len - 1) / 2;
+	if (s[0] != ':' || len % 2 == 0 || n < 5 || n > sizeof(rec))
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		hi = hex_nibble[(unsigned char)s[1 + 2 * i]];
+		lo = hex_nibble[(unsigned char)s[2 + 2 * i]];
+		if (!hi || !lo)
+			return -1;
+		rec[i] = (hi - 1) << 4 | (lo - 1);
+		sum += rec[i];
+	}
+	if (sum || rec[0] != n - 5)
+		return -1;
+
+	switch (rec[3]) {
+	case 0x00: /* data */
+		return sink_put_at(sink, *base + (rec[1] << 8 | rec[2]),
+				   rec + 4, rec[0]) ? 1 : 0;
+	case 0x01: /* end of file */
+		*end = 1;
+		return 0;
+	case 0x02: /* extended segment address */
+		if (rec[0] != 2)
+			return -1;
+		*base = (size_t)(rec[4] << 8 | rec[5]) << 4;
+		return 0;
+	case 0x04: /* extended linear address */
+		if (rec[0] != 2)
+			return -1;
+		*base = (size_t)(rec[4] << 8 | rec[5]) << 16;
+		return 0;
+	case 0x03:
+	case 0x05: /* start address, meaningless for a bitstream */
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Intel HEX, a line at a time. Data records may come in any order; gaps
+ * between them are left erased. Input past the end of file record is
+ * ignored, and input without one is taken to be cut short.
+ */
+static int stream_ihex(struct h2b_input *in, struct h2b_sink *sink,
+		       const char *inp)
+{
+	const size_t size = H2B_CHUNK_LINES * H2B_LINE_LEN;
+	size_t pending = 0, start, base = 0;
+	unsigned long line = 0;
+	char *data, *eol;
+	ssize_t nread;
+	int end = 0, last = 0;
+	int ret = 0;
+
+	data = malloc(size);
+	if (!data) {
+		printf("Unable to allocate conversion buffers\n");
+		return -1;
+	}
+
+	while (!end && !last) {
+		nread = input_read(in, data + pending, size - pending);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			printf(in->dec ? "Unable to decompress %s\n" :
+					 "Unable to read %s\n", inp);
+			ret = -1;
+			goto out;
+		}
+		pending += nread;
+		/* the last line need not end in a newline */
+		last = nread == 0;
+
+		for (start = 0; start < pending && !end; start = eol - data + 1) {
+			eol = memchr(data + start, '\n', pending - start);
+			if (!eol) {
+				if (!last)
+					break;
+				eol = data + pending;
+			}
+
+			line++;
+			ret = ihex_record(data + start, eol - data - start,
+					  sink, &base, &end);
+			if (ret) {
+				if (ret < 0)
+					printf("File is not properly formatted at line %lu\n",
+					       line);
+				else
+					printf("File is not properly written!\n");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		/* past the unterminated last line */
+		if (start > pending)
+			start = pending;
+		pending -= start;
+		memmove(data, data + start, pending);
+		if (pending == size) {
+			printf("File is not properly formatted at line %lu\n",
+			       line + 1);
+			ret = -1;
+			goto out;
 		}
 	}
-	fseek(input, 0, SEEK_SET);
 
-	output = fopen(out, "wb");
-	if (output == NULL) {
-		printf("Unable to open %s\n", out);
+	if (!end) {
+		printf("%s ends without an Intel HEX end of file record\n", inp);
 		ret = -1;
-		goto err_output;
 	}
 
-	while ((nread = getline(&line, &len, input)) != -1) {
-		strcpy(data, "0x");
-		strcat(data, line);
-		if (nread != 3) {
-			printf("File is not properly formatted: %s\n", data);
+out:
+	free(data);
+
+	return ret;
+}
+
+/* A binary image, copied as is */
+static int stream_raw(struct h2b_input *in, struct h2b_sink *sink,
+		      const char *inp)
+{
+	const size_t size = H2B_CHUNK_LINES * H2B_LINE_LEN;
+	uint8_t *data;
+	ssize_t nread;
+	int ret = 0;
+
+	data = malloc(size);
+	if (!data) {
+		printf("Unable to allocate conversion buffers\n");
+		return -1;
+	}
+
+	for (;;) {
+		nread = input_read(in, data, size);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			printf(in->dec ? "Unable to decompress %s\n" :
+					 "Unable to read %s\n", inp);
 			ret = -1;
-			goto err_read;
+			break;
 		}
-		data[strcspn(data, "\n")] = 0;
-		array[i] = (uint8_t)strtol(data, NULL, 16);
-		i++;
+		if (nread == 0)
+			break;
+
+		if (sink_put(sink, data, nread)) {
+			printf("File is not properly written!\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	free(data);
+
+	return ret;
+}
+
+/*
+ * Fallback for inputs that cannot be mapped (pipes, character devices,
+ * compressed files) and for Intel HEX: decode in a single pass through a
+ * fixed size working buffer.
+ */
+static int convert_stream(struct h2b_input *in, struct h2b_sink *sink,
+			  const char *inp)
+{
+	switch (in->format) {
+	case H2B_FORMAT_IHEX:
+		return stream_ihex(in, sink, inp);
+	case H2B_FORMAT_RAW:
+		return stream_raw(in, sink, inp);
+	default:
+		return stream_efinix(in, sink, inp);
+	}
+}
+
+/**
+ * @brief Load an image into memory, see h2b_detect() for the formats.
+ *
+ * A binary image in a regular file is mapped and used as is, without
+ * converting or copying it; the file must not change until it is
+ * released. Regular Efinix hex files are mapped and decoded in parallel,
+ * anything else is streamed into a growing buffer. Compressed files are
+ * decompressed on the fly.
+ *
+ * @param inp    Path of the input file.
+ * @param out    Returns the image, to be released with free(), or with
+ *               munmap() if @p mapped is set.
+ * @param size   Returns the size of the image.
+ * @param mapped Returns 1 if @p out is the mapped input file.
+ * @return 0 on success, -1 on error.
+ */
+int convert_to_buffer(const char *inp, uint8_t **out, size_t *size,
+		      int *mapped)
+{
+	struct h2b_sink sink = { .buf = NULL };
+	struct h2b_input in;
+	struct stat st;
+	const char *src;
+	size_t lines;
+	long bad;
+	int ret = 0;
+
+	if (!inp) {
+		printf("Specify filename!\n");
+		return -1;
 	}
 
-	elements_written = fwrite(array, sizeof(uint8_t), count, output);
+	if (open_input(inp, &in) < 0)
+		return -1;
+
+	*mapped = 0;
+	if (in.dec || in.format == H2B_FORMAT_IHEX ||
+	    fstat(in.fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size)
+		goto stream;
 
-	if (elements_written != count) {
-		printf("File is not properly written!\n");
+	src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in.fd, 0);
+	if (src == MAP_FAILED)
+		goto stream;
+
+	if (in.format == H2B_FORMAT_RAW) {
+		/* read by every pass, so not MADV_SEQUENTIAL */
+		madvise((void *)src, st.st_size, MADV_WILLNEED);
+		close_input(&in);
+		*out = (uint8_t *)src;
+		*size = st.st_size;
+		*mapped = 1;
+		return 0;
+	}
+	/* advice values are not flags, each needs its own call */
+	madvise((void *)src, st.st_size, MADV_SEQUENTIAL);
+	madvise((void *)src, st.st_size, MADV_WILLNEED);
+
+	lines = st.st_size / H2B_LINE_LEN;
+	sink.buf = malloc(lines ? lines : 1);
+	if (!sink.buf) {
+		printf("Unable to allocate %zu bytes for %s\n", lines, inp);
 		ret = -1;
+		goto err_map;
 	}
+	sink.len = lines;
 
-err_read:
-	free(line);
-	fclose(output);
-err_output:
-	fclose(input);
-err_input:
-	free(data);
-	free(array);
+	bad = decode_parallel(src, lines, sink.buf);
+	if (bad >= 0) {
+		printf("File is not properly formatted at line %ld\n",
+		       bad + 1);
+		ret = -1;
+	} else if (st.st_size % H2B_LINE_LEN) {
+		printf("File is not properly formatted at line %zu\n",
+		       lines + 1);
+		ret = -1;
+	}
 
-	return ret;
+err_map:
+	munmap((void *)src, st.st_size);
+	goto out;
+
+stream:
+	ret = convert_stream(&in, &sink, inp);
+out:
+	close_input(&in);
+
+	if (ret < 0) {
+		free(sink.buf);
+		return ret;
+	}
+
+	*out = sink.buf;
+	*size = sink.len;
+	return 0;
 }
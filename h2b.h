@@ -1 +1,29 @@
-int convert_to_bin(const char *inp, const char *out);
+#include <stddef.h>
+#include <stdint.h>
+
+/* every record of the Efinix hex file is one byte: "XX\n" */
+#define H2B_LINE_LEN 3
+
+/* bytes at the start of the (decompressed) input that decide its format */
+#define H2B_DETECT_LEN 64
+
+enum h2b_format {
+	H2B_FORMAT_EFINIX,	/* one "XX\n" record per byte */
+	H2B_FORMAT_IHEX,	/* Intel HEX */
+	H2B_FORMAT_RAW,		/* the binary image as is, e.g. .bin or .bit */
+};
+
+enum h2b_format h2b_detect(const char *name, const uint8_t *head, size_t len);
+int convert_to_buffer(const char *inp, uint8_t **out, size_t *size,
+		      int *mapped);
+
+/*
+ * Decode @lines "XX\n" records from @src into @dst using the fastest
+ * kernel the CPU supports. Returns -1 on success, otherwise the index of
+ * the first malformed record.
+ */
+long h2b_decode(const char *src, size_t lines, uint8_t *dst);
+
+/* Force a decode kernel by name ("avx2", "sse2", "neon", "scalar") */
+int h2b_set_kernel(const char *name);
+const char *h2b_kernel_name(void);
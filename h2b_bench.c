@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Microbenchmark of the hex decode kernels against the original
+ * getline()/strtol() per line conversion.
+ *
+ * Usage: h2b_bench [SIZE_MB] [ITERATIONS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "h2b.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the conversion loop convert_to_bin() used before the streaming decoder */
+static long decode_strtol(const char *src, size_t lines, uint8_t *dst)
+{
+	FILE *input = fmemopen((void *)src, lines * H2B_LINE_LEN, "r");
+	char data[5], *line = NULL;
+	size_t len = 0, i = 0;
+	ssize_t nread;
+
+	if (!input)
+		return 0;
+
+	while ((nread = getline(&line, &len, input)) != -1) {
+		strcpy(data, "0x");
+		strcat(data, line);
+		if (nread != 3)
+			break;
+		data[strcspn(data, "\n")] = 0;
+		dst[i++] = (uint8_t)strtol(data, NULL, 16);
+	}
+
+	free(line);
+	fclose(input);
+	return i == lines ? -1 : (long)i;
+}
+
+static void run(const char *name, long (*fn)(const char *, size_t, uint8_t *),
+		const char *src, size_t lines, const uint8_t *ref, uint8_t *dst,
+		int iterations)
+{
+	double start, best = 0;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		memset(dst, 0, lines);
+		start = now();
+		if (fn(src, lines, dst) != -1 || memcmp(dst, ref, lines)) {
+			printf("%-8s decode mismatch\n", name);
+			return;
+		}
+		start = now() - start;
+		if (!best || start < best)
+			best = start;
+	}
+
+	printf("%-8s %9.3f ms %9.1f MB/s\n", name, best * 1e3,
+	       lines / best / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+	static const char digits[] = "0123456789abcdef";
+	size_t size_mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 16;
+	int iterations = argc > 2 ? atoi(argv[2]) : 5;
+	size_t lines = size_mb << 20, i;
+	uint8_t *ref, *dst;
+	char *src;
+
+	if (!lines || iterations <= 0) {
+		fprintf(stderr, "Usage: %s [SIZE_MB] [ITERATIONS]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	src = malloc(lines * H2B_LINE_LEN);
+	ref = malloc(lines);
+	dst = malloc(lines);
+	if (!src || !ref || !dst) {
+		fprintf(stderr, "Malloc failed\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (i = 0; i < lines; i++) {
+		ref[i] = rand();
+		src[i * H2B_LINE_LEN] = digits[ref[i] >> 4];
+		src[i * H2B_LINE_LEN + 1] = digits[ref[i] & 0xf];
+		src[i * H2B_LINE_LEN + 2] = '\n';
+	}
+
+	printf("%zu MiB image, best of %d, MB/s of decoded output\n", size_mb,
+	       iterations);
+	run("strtol", decode_strtol, src, lines, ref, dst, iterations);
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (h2b_set_kernel(kernels[i]))
+			continue;
+		run(kernels[i], h2b_decode, src, lines, ref, dst, iterations);
+	}
+
+	free(src);
+	free(ref);
+	free(dst);
+	return EXIT_SUCCESS;
+}
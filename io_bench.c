@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Benchmark of the sync and io_uring engines: writes and reads back
+ * a file (or device) in fixed size blocks on an O_SYNC descriptor, the
+ * way fcp drives the flash. Everything in FILE is overwritten.
+ *
+ * Usage: io_bench FILE [SIZE_MB] [BLOCK_KB] [ITERATIONS]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "uring.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the current path: one blocking call per block at the file offset */
+static int run_sync(int fd, int write_op, uint8_t *buf, size_t size,
+		    size_t block)
+{
+	size_t off, len;
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	for (off = 0; off < size; off += len) {
+		len = size - off < block ? size - off : block;
+		ret = write_op ? write(fd, buf + off, len) :
+				 read(fd, buf + off, len);
+		if (ret != (ssize_t)len)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int run_uring(int fd, int write_op, uint8_t *buf, size_t size,
+		     size_t block)
+{
+	size_t nr = (size + block - 1) / block, next = 0, done = 0, len;
+	struct uring r;
+	uint64_t n;
+	int res;
+
+	if (uring_init(&r, URING_DEPTH) < 0)
+		return -1;
+
+	while (done < nr) {
+		for (; next < nr && next - done < URING_DEPTH; next++) {
+			len = size - next * block < block ? size - next * block :
+							    block;
+			if (uring_queue(&r, write_op, fd, buf + next * block, len,
+					next * block, next) < 0)
+				break;
+		}
+
+		if (uring_wait(&r, &n, &res) < 0 || res < 0) {
+			uring_exit(&r);
+			return -1;
+		}
+		done++;
+	}
+
+	uring_exit(&r);
+	return 0;
+}
+
+static void run(const char *name,
+		int (*fn)(int, int, uint8_t *, size_t, size_t), int fd,
+		uint8_t *src, uint8_t *dst, size_t size, size_t block,
+		int iterations)
+{
+	double start, best_write = 0, best_read = 0;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		start = now();
+		if (fn(fd, 1, src, size, block) < 0) {
+			printf("%-8s unavailable\n", name);
+			return;
+		}
+		start = now() - start;
+		if (!best_write || start < best_write)
+			best_write = start;
+
+		memset(dst, 0, size);
+		start = now();
+		if (fn(fd, 0, dst, size, block) < 0 || memcmp(src, dst, size)) {
+			printf("%-8s read mismatch\n", name);
+			return;
+		}
+		start = now() - start;
+		if (!best_read || start < best_read)
+			best_read = start;
+	}
+
+	printf("%-8s write %9.1f MB/s  read %9.1f MB/s\n", name,
+	       size / best_write / 1e6, size / best_read / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size_mb = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+	size_t block = (argc > 3 ? strtoul(argv[3], NULL, 0) : 64) << 10;
+	int iterations = argc > 4 ? atoi(argv[4]) : 3;
+	size_t size = size_mb << 20, i;
+	uint8_t *src, *dst;
+	int fd;
+
+	if (argc < 2 || !size || !block || iterations <= 0) {
+		fprintf(stderr,
+			"Usage: %s FILE [SIZE_MB] [BLOCK_KB] [ITERATIONS]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_SYNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1],
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	src = malloc(size);
+	dst = malloc(size);
+	if (!src || !dst) {
+		fprintf(stderr, "Malloc failed\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (i = 0; i < size; i++)
+		src[i] = rand();
+
+	printf("%zu MiB in %zu KiB blocks, O_SYNC, best of %d\n", size_mb,
+	       block >> 10, iterations);
+	run("sync", run_sync, fd, src, dst, size, block, iterations);
+	run("uring", run_uring, fd, src, dst, size, block, iterations);
+
+	close(fd);
+	free(src);
+	free(dst);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Progress journal of a full flash, so --resume can pick up an
+ * interrupted run where it stopped instead of from block 0. The journal
+ * is a single checksummed record, rewritten in place at most every
+ * JOURNAL_INTERVAL_MS and removed once the image is verified.
+ */
+
+#include "flashcp.h"
+#include "crc32c.h"
+#include "journal.h"
+#include <libgen.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void journal_default_path(char *path, size_t len, const char *device)
+{
+	char *copy = strdup(device);
+
+	snprintf(path, len, "%s/%s.journal", MANIFEST_DIR,
+		 copy ? basename(copy) : "mtd");
+	free(copy);
+}
+
+/* the record describes a flash of the image @m on the same geometry */
+static int record_matches(const struct journal_record *rec,
+			  const struct manifest *m)
+{
+	uint32_t crc = crc32c(0, rec, offsetof(struct journal_record, crc));
+
+	return !memcmp(rec->magic, JOURNAL_MAGIC, sizeof(rec->magic)) &&
+	       rec->crc == crc &&
+	       rec->mtd_size == m->mtd_size &&
+	       rec->image_size == m->image_size &&
+	       rec->erasesize == m->erasesize &&
+	       rec->image_crc == m->image_crc && rec->written <= rec->erased;
+}
+
+/**
+ * @brief Open the journal for a full flash of the image @p m.
+ *
+ * @param resume Keep the progress of an earlier run of the same image,
+ * else start over.
+ * @return 1 if there is progress to resume from, 0 if not, -1 if the
+ * journal cannot be written (the run goes on without one).
+ */
+int journal_open(struct journal *j, const char *path,
+		 const struct manifest *m, int resume)
+{
+	char *dir;
+	int ret = 0;
+
+	memset(j, 0, sizeof(*j));
+	snprintf(j->path, sizeof(j->path), "%s", path);
+
+	dir = strdup(path);
+	if (dir)
+		mkdir(dirname(dir), 0755);
+	free(dir);
+
+	j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->fd < 0)
+		return -1;
+
+	if (resume &&
+	    pread(j->fd, &j->rec, sizeof(j->rec), 0) == sizeof(j->rec) &&
+	    record_matches(&j->rec, m)) {
+		ret = j->rec.written || j->rec.erased;
+	} else {
+		memset(&j->rec, 0, sizeof(j->rec));
+		memcpy(j->rec.magic, JOURNAL_MAGIC, sizeof(j->rec.magic));
+		j->rec.mtd_size = m->mtd_size;
+		j->rec.image_size = m->image_size;
+		j->rec.erasesize = m->erasesize;
+		j->rec.image_crc = m->image_crc;
+	}
+
+	/* from here on the journal says this image is being flashed */
+	j->dirty = 1;
+	journal_sync(j);
+	return ret;
+}
+
+/**
+ * @brief Record progress, writing it out if the last write is more than
+ * JOURNAL_INTERVAL_MS old. The erased end never moves back: blocks once
+ * erased stay worth a blank check.
+ */
+void journal_update(struct journal *j, uint32_t erased, uint32_t written)
+{
+	if (j->fd < 0)
+		return;
+
+	if (erased > j->rec.erased)
+		j->rec.erased = erased;
+	if (written > j->rec.erased)
+		j->rec.erased = written;
+	j->rec.written = written;
+	j->dirty = 1;
+
+	if (now_ns() - j->synced_ns >= JOURNAL_INTERVAL_MS * 1000000ULL)
+		journal_sync(j);
+}
+
+/* Write out the progress not in the journal yet */
+void journal_sync(struct journal *j)
+{
+	if (j->fd < 0 || !j->dirty)
+		return;
+
+	j->rec.crc = crc32c(0, &j->rec, offsetof(struct journal_record, crc));
+	if (pwrite(j->fd, &j->rec, sizeof(j->rec), 0) != sizeof(j->rec) ||
+	    fdatasync(j->fd) < 0)
+		log_verbose("Failed to update journal %s: %m\n", j->path);
+	j->dirty = 0;
+	j->synced_ns = now_ns();
+}
+
+/* Keep the journal for a later --resume, e.g. when the run fails */
+void journal_close(struct journal *j)
+{
+	if (j->fd < 0)
+		return;
+
+	journal_sync(j);
+	close(j->fd);
+	j->fd = -1;
+}
+
+/* The image is on the flash and verified, nothing left to resume */
+void journal_done(struct journal *j)
+{
+	if (j->fd < 0)
+		return;
+
+	close(j->fd);
+	j->fd = -1;
+	if (unlink(j->path) < 0 && errno != ENOENT)
+		log_verbose("Failed to remove %s: %m\n", j->path);
+}
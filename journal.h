@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "manifest.h"
+
+#define JOURNAL_MAGIC "FCPJRNL1"
+
+/*
+ * least time between two writes of the journal: each is synced, and
+ * /var/lib/fcp is often on eMMC. Resuming reads back what was written
+ * since anyway.
+ */
+#define JOURNAL_INTERVAL_MS 2000
+
+/*
+ * How far a full flash got: the image it is for, the end of the erased
+ * part of the flash and the end of the part programmed without error.
+ */
+struct journal_record {
+	char magic[8];
+	uint64_t mtd_size;
+	uint64_t image_size;
+	uint32_t erasesize;
+	uint32_t image_crc;
+	uint32_t erased, written;
+	/* CRC32C of everything before it */
+	uint32_t crc;
+};
+
+struct journal {
+	int fd;
+	char path[256];
+	struct journal_record rec;
+	uint64_t synced_ns;
+	int dirty;
+};
+
+void journal_default_path(char *path, size_t len, const char *device);
+int journal_open(struct journal *j, const char *path,
+		 const struct manifest *m, int resume);
+void journal_update(struct journal *j, uint32_t erased, uint32_t written);
+void journal_sync(struct journal *j);
+void journal_close(struct journal *j);
+void journal_done(struct journal *j);
+
+#endif /* JOURNAL_H */
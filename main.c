@@ -33,8 +33,24 @@
 
 #include "flashcp.h"
 #include "h2b.h"
+#include "eraser.h"
+#include "crc32c.h"
+#include "manifest.h"
+#include "verifier.h"
+#include "xfer.h"
+#include "uring.h"
+#include "daemon.h"
+#include "bringup.h"
+#include "gpiocdev.h"
+#include "stats.h"
+#include "flash.h"
+#include "cache.h"
+#include "journal.h"
 #include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 /* for debugging purposes only */
 #ifdef DEBUG
@@ -53,13 +69,27 @@
 #define PERCENTAGE(x, total) (((x)*100) / (total))
 #define DELETE_MODULE(name, flags) syscall(__NR_delete_module, name, flags)
 
+/* how long one bring-up attempt waits for the MTD device to appear */
+#define FLASH_PROBE_TIMEOUT_MS 1000
+
 /* cmd-line flags */
 #define FLAG_NONE 0x00
 #define FLAG_HELP 0x02
 #define FLAG_FILENAME 0x04
+/* the flash was brought up, and is handed back to the FPGA at the end */
 #define FLAG_DEVICE 0x08
 #define FLAG_ERASE_ALL 0x10
 #define FLAG_PARTITION 0x20
+#define FLAG_BLANK_CHECK 0x40
+#define FLAG_NO_MANIFEST 0x80
+#define FLAG_DIGEST 0x100
+#define FLAG_VERIFY_LAG 0x200
+#define FLAG_CALIBRATE 0x400
+#define FLAG_WORKER 0x800
+#define FLAG_RESUME 0x1000
+
+/* devices that can be flashed in one invocation */
+#define MAX_TARGETS 16
 
 static void show_usage()
 {
@@ -69,10 +99,64 @@ static void show_usage()
 	printf("  -h, --help            Show this help message and exit.\n");
 	printf("  -v, --verbose         Enable verbose mode.\n");
 	printf("  -p, --partition       Copy to a specific partition.\n");
+	printf("  -d, --device=PATH     MTD device to write (default /dev/mtd0).\n");
+	printf("  -b, --backend=NAME[:OPTIONS]\n");
+	printf("                        Flash behind --device: \"mtd\", \"block\" or\n");
+	printf("                        \"sim\", a NOR simulator in a regular file\n");
+	printf("                        (default: by the type of the device).\n");
+	printf("  -T, --target=DEV:FILE Flash FILE to DEV. Repeat to flash up to %d\n",
+	       MAX_TARGETS);
+	printf("                        devices in parallel, one process each.\n");
 	printf("  -A, --erase-all       Erase the entire device before copying.\n");
+	printf("  -E, --erase-ahead=N   Erase at most N blocks ahead of the block\n");
+	printf("                        being written (default %d, 0 erases\n",
+	       ERASE_AHEAD_DEFAULT);
+	printf("                        everything before writing).\n");
+	printf("  -B, --blank-check     Skip erasing blocks that are already blank.\n");
+	printf("  -M, --manifest=PATH   Block checksum manifest used by --partition\n");
+	printf("                        (default %s/<device>.manifest).\n",
+	       MANIFEST_DIR);
+	printf("  -N, --no-manifest     Do not use or update the manifest.\n");
+	printf("  -D, --digest          Print the image and per block CRC32C digests.\n");
+	printf("  -K, --cache=SIZE      Keep decoded images and their digests in\n");
+	printf("                        %s, at most SIZE (k/m suffix,\n",
+	       CACHE_DIR);
+	printf("                        default 0, off).\n");
+	printf("  -L, --verify-lag=K    Verify each block while the block K blocks\n");
+	printf("                        after it is written, instead of in a\n");
+	printf("                        separate pass.\n");
+	printf("  -X, --xfer-size=SIZE  Read and write SIZE bytes (k/m suffix) per\n");
+	printf("                        call (default: calibrated, else 1 block).\n");
+	printf("  -I, --io-engine=NAME  Device I/O through \"sync\" read()/write()\n");
+	printf("                        (default) or \"uring\", io_uring with %d\n",
+	       URING_DEPTH);
+	printf("                        requests in flight.\n");
+	printf("  -R, --resume          Continue an interrupted flash of the same\n");
+	printf("                        image from the first block that does not\n");
+	printf("                        read back right, see --journal.\n");
+	printf("  -J, --journal=PATH    Progress journal of a full flash\n");
+	printf("                        (default %s/<device>.journal).\n",
+	       MANIFEST_DIR);
+	printf("  -C, --calibrate       Measure the best transfer size and save it\n");
+	printf("                        to %s. FILE is optional.\n",
+	       XFER_CONF);
+	printf("  -t, --stats[=FORMAT]  Print the time, throughput and latencies of\n");
+	printf("                        each phase at exit, as \"text\" (default)\n");
+	printf("                        or one \"json\" line.\n");
+	printf("  -S, --serve[=SOCKET]  Run as a daemon taking jobs on SOCKET\n");
+	printf("                        (default %s). The flash stays\n",
+	       DAEMON_SOCKET);
+	printf("                        up until no job came for %d ms.\n",
+	       DAEMON_IDLE_MS);
+	printf("  -c, --connect[=SOCKET] Run the other options as a job on the\n");
+	printf("                        daemon. Give it as a separate argument.\n");
 	printf("  -V, --version         Display the program version.\n");
 	printf("  -r, --read_from_flash Give flash access to FPGA.\n");
 	printf("  -e, --external_cable  Program FPGA from the external cable.\n");
+	printf("  -g, --gpio=CHIP:R,C   Drive RESET and CONDONE as lines R and C of\n");
+	printf("                        /dev/CHIP (default: GPIO %s and %s,\n",
+	       RESET_GPIO, CONDONE_GPIO);
+	printf("                        through sysfs if no chip has them).\n");
 	printf("\nArguments:\n");
 	printf("  FILE                  The input file to copy to the flash device.\n");
 	printf("\nExamples:\n");
@@ -80,48 +164,595 @@ static void show_usage()
 	       PROGRAM_NAME);
 	printf("  %s -A firmware.bin    Copy and erase firmware.bin to the entire device.\n",
 	       PROGRAM_NAME);
+	printf("  %s -T /dev/mtd0:a.hex -T /dev/mtd1:b.hex\n", PROGRAM_NAME);
+	printf("                        Flash two devices at the same time.\n");
 	printf("\n");
 }
 
 /******************************************************************************/
 
-static int dev_fd = -1, fil_fd = -1;
+static struct flash dev = { .fd = -1 };
+
+/* decoded image, shared by the erase, write, verify and diff passes */
+static uint8_t *image;
+static size_t image_size;
+/* image is mapped, from a binary input file or from the cache */
+static int image_mapped;
+
+static struct cache cache = { .limit = CACHE_LIMIT_DEFAULT };
+
+/* per block and whole image CRC32C of the image, computed once */
+static struct manifest digests;
+
+/* progress of a full flash, for --resume */
+static struct journal journal = { .fd = -1 };
+
+/*
+ * At exit only the journal is saved: a thread may still be using the
+ * device and the image, and the kernel releases both anyway.
+ */
+static void exit_cleanup(void)
+{
+	journal_close(&journal);
+}
 
 static void cleanup(void)
 {
-	if (dev_fd > 0)
-		close(dev_fd);
-	if (fil_fd > 0)
-		close(fil_fd);
+	/* a failed run leaves its progress behind for --resume */
+	journal_close(&journal);
+	flash_close(&dev);
+	if (image_mapped)
+		munmap(image, image_size);
+	else
+		free(image);
+	image = NULL;
+	manifest_free(&digests);
+}
+
+struct write_ctx {
+	const char *device;
+	/* where the writes start, past the blocks a resumed run kept */
+	size_t base;
+	/* end of the flash erased up front, 0 if erased by @eraser */
+	uint32_t erased;
+	/* background eraser to wait on, NULL if erased up front */
+	struct eraser *eraser;
+	/* verifier trailing the writes, NULL to verify in a separate pass */
+	struct verifier *verifier;
+};
+
+/* Exit on the main thread if the background eraser @e failed */
+static void check_eraser(const struct eraser *e, int ret)
+{
+	if (!ret)
+		return;
+
+	log_verbose("\n");
+	log_failure("While %s blocks 0x%.8x-0x%.8x on %s: %s\n",
+		    e->error_what, e->error_start, e->error_end, dev.device,
+		    strerror(e->error));
+}
+
+/* Note that the image is programmed up to @end */
+static void write_journal(struct write_ctx *wctx, size_t end)
+{
+	/* the eraser is ahead of the writes, by how much is not recorded */
+	journal_update(&journal, wctx->eraser ? end : wctx->erased, end);
+}
+
+static void write_progress(size_t end)
+{
+	log_verbose("\rWriting data: %lluk/%lluk (%llu%%)",
+		    KB((unsigned long long)end),
+		    KB((unsigned long long)image_size),
+		    PERCENTAGE((unsigned long long)end,
+			       (unsigned long long)image_size));
+}
+
+/* Write @len bytes of the image at @off to the device */
+static void write_block(struct write_ctx *wctx, size_t off, size_t len)
+{
+	write_progress(off + len);
+
+	if (wctx->eraser)
+		check_eraser(wctx->eraser,
+			     eraser_wait(wctx->eraser, off + len));
+
+	flash_program(&dev, image + off, len, off);
+	write_journal(wctx, off + len);
+
+	if (wctx->verifier)
+		verifier_advance(wctx->verifier, off + len);
+}
+
+/* Program the image straight from memory, @block bytes per call */
+static void write_sync(struct write_ctx *wctx, size_t block)
+{
+	size_t off, len;
+
+	for (off = wctx->base; off < image_size; off += len) {
+		len = image_size - off < block ? image_size - off : block;
+		write_block(wctx, off, len);
+	}
+}
+
+/*
+ * Check that an io_uring request moved all @len bytes at @off. If not,
+ * the caller does it again through the flash_* calls and their retries.
+ */
+static int uring_result_ok(int res, const char *what, size_t off, size_t len,
+			   const char *device)
+{
+	if (res == (int)len)
+		return 1;
+
+	log_verbose("\n");
+	if (res < 0)
+		log_verbose("While %s 0x%.8zx-0x%.8zx on %s: %s, retrying\n",
+			    what, off, off + len, device, strerror(-res));
+	else
+		log_verbose("Short count while %s 0x%.8zx-0x%.8zx on %s: %d bytes, retrying\n",
+			    what, off, off + len, device, res);
+	return 0;
+}
+
+/*
+ * Write the image straight from memory with URING_DEPTH blocks in
+ * flight. Requests complete in any order, so the verifier is only told
+ * about the contiguous prefix that is done.
+ */
+static void write_uring(struct uring *r, struct write_ctx *wctx, size_t block)
+{
+	size_t base = wctx->base;
+	size_t nr = (image_size - base + block - 1) / block, next = 0, done = 0;
+	size_t off, len;
+	uint8_t finished[URING_DEPTH] = { 0 };
+	uint64_t n, queued[URING_DEPTH];
+	unsigned long enters = r->enters;
+	int res;
+
+	while (done < nr) {
+		for (; next < nr && next - done < URING_DEPTH; next++) {
+			off = base + next * block;
+			len = image_size - off < block ? image_size - off : block;
+			write_progress(off + len);
+
+			if (wctx->eraser)
+				check_eraser(wctx->eraser,
+					     eraser_wait(wctx->eraser,
+							 off + len));
+			if (uring_queue(r, 1, dev.fd, image + off, len, off,
+					next) < 0)
+				break;
+			queued[next % URING_DEPTH] = stats_start();
+		}
+
+		if (uring_wait(r, &n, &res) < 0)
+			log_failure("Failed to wait for io_uring: %m\n");
+		off = base + n * block;
+		len = image_size - off < block ? image_size - off : block;
+		if (!uring_result_ok(res, "writing data to", off, len,
+				     wctx->device))
+			flash_program(&dev, image + off, len, off);
+		/* the enter calls since the last completion are its syscalls */
+		stats_op(len, queued[n % URING_DEPTH], r->enters - enters);
+		enters = r->enters;
+
+		finished[n % URING_DEPTH] = 1;
+		while (done < next && finished[done % URING_DEPTH])
+			finished[done++ % URING_DEPTH] = 0;
+
+		off = done < nr ? base + done * block : image_size;
+		write_journal(wctx, off);
+		if (wctx->verifier)
+			verifier_advance(wctx->verifier, off);
+	}
+}
+
+/* Record the checksums of the image now on the flash for the next diff */
+static void save_manifest(const char *path)
+{
+	if (manifest_save(&digests, path) < 0)
+		log_verbose("Failed to save manifest %s\n", path);
+}
+
+/* block @n of the image is already on flash according to manifest @m */
+static int manifest_trusts(const struct manifest *m, uint32_t n)
+{
+	return manifest_matches(m, &digests, n);
+}
+
+/*
+ * Block @n of the image must be read back to tell if and how it changed:
+ * manifest @m does not vouch for it, and either does not cover it or the
+ * flash may take the new data without an erase, which needs the old.
+ */
+static int diff_needs_read(const struct manifest *m, uint32_t n)
+{
+	if (manifest_trusts(m, n))
+		return 0;
+	return !m->crc || n >= m->nr_blocks ||
+	       dev.info.flags & MTD_BIT_WRITEABLE;
 }
 
+/* offset of the first byte that differs between @a and @b */
+static size_t first_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+/*
+ * Erase and program again the block at @off that read back wrong, up to
+ * FLASH_RETRIES times. Returns 0 once it reads back right.
+ */
+static int repair_block(size_t off, size_t len)
+{
+	uint8_t *buf;
+	int attempt, ret = -1;
+
+	/* the blocks of the digests are erase blocks only without regions */
+	if (dev.nr_regions)
+		return -1;
+
+	buf = malloc(len);
+	if (!buf)
+		log_failure("Malloc failed");
+
+	for (attempt = 1; attempt <= FLASH_RETRIES && ret; attempt++) {
+		log_verbose("\nRewriting block 0x%.8zx-0x%.8zx (%d/%d)\n", off,
+			    off + len, attempt, FLASH_RETRIES);
+		flash_erase(&dev, off, dev.info.erasesize);
+		flash_program(&dev, image + off, len, off);
+		flash_read(&dev, buf, len, off);
+		if (!memcmp(buf, image + off, len))
+			ret = 0;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Compare @len bytes read back from flash at @off with the digests, one
+ * erase block at a time, and find the exact byte if they differ. A block
+ * that differs is rewritten before giving up.
+ */
+static void verify_chunk(const uint8_t *buf, size_t off, size_t len)
+{
+	size_t blk, blen, at;
+
+	for (blk = 0; blk < len; blk += blen) {
+		at = off + blk;
+		blen = len - blk < digests.erasesize ? len - blk :
+						       digests.erasesize;
+		if (crc32c(0, buf + blk, blen) ==
+			    digests.crc[at / digests.erasesize] ||
+		    repair_block(at, blen) == 0)
+			continue;
+
+		log_verbose("\n");
+		log_failure(
+			"File does not seem to match flash data. First mismatch at 0x%.8zx in 0x%.8zx-0x%.8zx\n",
+			at + first_mismatch(image + at, buf + blk, blen), at,
+			at + blen);
+	}
+}
+
+/*
+ * Read back the blocks an interrupted run programmed, up to @written, in
+ * @chunk sized reads into @buf. Returns the offset of the first block
+ * that does not match the image, where the writes resume.
+ */
+static size_t resume_point(size_t written, uint8_t *buf, size_t chunk)
+{
+	size_t off, len, blk, blen;
+	uint32_t n;
+
+	/* a block programmed in part has to be erased again */
+	if (written < image_size)
+		written -= written % digests.erasesize;
+	else
+		written = image_size;
+
+	for (off = 0; off < written; off += len) {
+		len = written - off < chunk ? written - off : chunk;
+		flash_read(&dev, buf, len, off);
+
+		for (blk = 0; blk < len; blk += blen) {
+			n = (off + blk) / digests.erasesize;
+			blen = manifest_block_len(&digests, n);
+			if (crc32c(0, buf + blk, blen) != digests.crc[n])
+				return off + blk;
+		}
+	}
+
+	return written;
+}
+
+static void verify_progress(size_t end)
+{
+	log_verbose("\rVerifying data: %luk/%lluk (%llu%%)", KB(end),
+		    KB((unsigned long long)image_size),
+		    PERCENTAGE((unsigned long long)end,
+			       (unsigned long long)image_size));
+}
+
+/* Read the image back with URING_DEPTH chunks of @chunk bytes in flight */
+static void verify_uring(struct uring *r, const char *device, size_t chunk)
+{
+	size_t nr = (image_size + chunk - 1) / chunk, next = 0, done = 0;
+	size_t off, len;
+	uint8_t finished[URING_DEPTH] = { 0 }, *bufs;
+	uint64_t n, queued[URING_DEPTH];
+	unsigned long enters = r->enters;
+	int res;
+
+	/* chunk n lands in slot n % URING_DEPTH, free once n - DEPTH is done */
+	bufs = malloc(chunk * URING_DEPTH);
+	if (!bufs)
+		log_failure("Malloc failed");
+
+	while (done < nr) {
+		for (; next < nr && next - done < URING_DEPTH; next++) {
+			off = next * chunk;
+			len = image_size - off < chunk ? image_size - off : chunk;
+			if (uring_queue(r, 0, dev.fd,
+					bufs + (next % URING_DEPTH) * chunk, len,
+					off, next) < 0)
+				break;
+			queued[next % URING_DEPTH] = stats_start();
+		}
+
+		if (uring_wait(r, &n, &res) < 0)
+			log_failure("Failed to wait for io_uring: %m\n");
+		off = n * chunk;
+		len = image_size - off < chunk ? image_size - off : chunk;
+		if (!uring_result_ok(res, "reading data from", off, len, device))
+			flash_read(&dev, bufs + (n % URING_DEPTH) * chunk, len,
+				   off);
+		stats_op(len, queued[n % URING_DEPTH], r->enters - enters);
+		enters = r->enters;
+		verify_chunk(bufs + (n % URING_DEPTH) * chunk, off, len);
+
+		finished[n % URING_DEPTH] = 1;
+		while (done < next && finished[done % URING_DEPTH])
+			finished[done++ % URING_DEPTH] = 0;
+		verify_progress(done < nr ? done * chunk : image_size);
+	}
+
+	free(bufs);
+}
+
+/* longest line of a worker relayed as one */
+#define RELAY_LINE 512
+
+/* one of a worker's output streams, relayed to ours line by line */
+struct relay {
+	int fd;
+	FILE *stream;
+	char buf[RELAY_LINE];
+	size_t len;
+};
+
+struct target {
+	const char *device;
+	const char *filename;
+	/* why the target was not flashed, NULL if a worker ran for it */
+	const char *error;
+	pid_t pid;
+	int status;
+	/* the worker's stdout and stderr */
+	struct relay relay[2];
+};
+
+/* @a and @b name the same device, also through different paths */
+static int same_device(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	if (!strcmp(a, b))
+		return 1;
+	if (stat(a, &sa) < 0 || stat(b, &sb) < 0)
+		return 0;
+	if ((S_ISCHR(sa.st_mode) && S_ISCHR(sb.st_mode)) ||
+	    (S_ISBLK(sa.st_mode) && S_ISBLK(sb.st_mode)))
+		return sa.st_rdev == sb.st_rdev;
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/*
+ * Print the complete lines buffered in @r tagged with @device, and the
+ * rest too if @flush.
+ */
+static void relay_lines(struct relay *r, const char *device, int flush)
+{
+	char *start = r->buf, *eol;
+	size_t left = r->len, n;
+
+	while ((eol = memchr(start, '\n', left)) || (flush && left)) {
+		n = eol ? (size_t)(eol - start) : left;
+		fprintf(r->stream, "[%s] %.*s\n", device, (int)n, start);
+		n += eol != NULL;
+		start += n;
+		left -= n;
+	}
+
+	memmove(r->buf, start, left);
+	r->len = left;
+	fflush(r->stream);
+}
+
+/* Relay the output of the workers until they have all closed it */
+static void relay_targets(struct target *t, int nr)
+{
+	struct pollfd pfd[MAX_TARGETS * 2];
+	struct relay *r;
+	int i, j, n;
+	ssize_t ret;
+
+	for (;;) {
+		for (i = 0, n = 0; i < nr; i++)
+			for (j = 0; j < 2; j++)
+				if (t[i].relay[j].fd >= 0) {
+					pfd[n].fd = t[i].relay[j].fd;
+					pfd[n++].events = POLLIN;
+				}
+		if (!n)
+			break;
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_failure("poll() failed: %m\n");
+		}
+
+		for (i = 0, n = 0; i < nr; i++) {
+			for (j = 0; j < 2; j++) {
+				r = &t[i].relay[j];
+				if (r->fd < 0 || !pfd[n++].revents)
+					continue;
+
+				ret = read(r->fd, r->buf + r->len,
+					   sizeof(r->buf) - r->len);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0) {
+					relay_lines(r, t[i].device, 1);
+					close(r->fd);
+					r->fd = -1;
+					continue;
+				}
+				r->len += ret;
+				/* a line too long for the buffer goes in parts */
+				relay_lines(r, t[i].device,
+					    r->len == sizeof(r->buf));
+			}
+		}
+	}
+}
 
 /**
- * @brief Check if a kernel module is loaded.
+ * @brief Fork one worker per target that was brought up.
+ *
+ * Everything a worker prints is relayed through a pipe and tagged with its
+ * device.
  *
- * @param module_name The name of the kernel module to check.
- * @return 1 if the module is loaded, 0 if not.
+ * @return in a worker, the index of its target; in the parent, -1 once
+ * every worker has exited, with their wait statuses in @p t.
  */
-int is_module_loaded(const char *module_name) {
-    FILE *fp;
-    char buffer[256];
-    int loaded = 0;
-
-    // Run 'lsmod' and check if the module is listed
-    fp = popen("lsmod", "r");
-    if (fp == NULL) {
-        return 0;
-    }
-
-    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-        if (strstr(buffer, module_name) != NULL) {
-            loaded = 1;
-            break;
-        }
-    }
-
-    pclose(fp);
-    return loaded;
+static int spawn_targets(struct target *t, int nr)
+{
+	int out[2], err[2];
+	pid_t pid;
+	int i, j, status;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < nr; i++) {
+		t[i].pid = -1;
+		t[i].relay[0].fd = t[i].relay[1].fd = -1;
+		if (t[i].error)
+			continue;
+
+		if (pipe(out) < 0) {
+			t[i].error = "not started";
+			continue;
+		}
+		if (pipe(err) < 0) {
+			close(out[0]);
+			close(out[1]);
+			t[i].error = "not started";
+			continue;
+		}
+
+		t[i].pid = fork();
+		if (t[i].pid == 0) {
+			for (j = 0; j < i; j++) {
+				if (t[j].relay[0].fd >= 0)
+					close(t[j].relay[0].fd);
+				if (t[j].relay[1].fd >= 0)
+					close(t[j].relay[1].fd);
+			}
+			if (dup2(out[1], STDOUT_FILENO) < 0 ||
+			    dup2(err[1], STDERR_FILENO) < 0)
+				_exit(EXIT_FAILURE);
+			close(out[0]);
+			close(out[1]);
+			close(err[0]);
+			close(err[1]);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			return i;
+		}
+
+		close(out[1]);
+		close(err[1]);
+		if (t[i].pid < 0) {
+			log_verbose("Failed to start %s: %m\n", t[i].device);
+			close(out[0]);
+			close(err[0]);
+			t[i].error = "not started";
+			continue;
+		}
+		t[i].relay[0] = (struct relay){ .fd = out[0], .stream = stdout };
+		t[i].relay[1] = (struct relay){ .fd = err[0], .stream = stderr };
+	}
+
+	relay_targets(t, nr);
+
+	while ((pid = wait(&status)) > 0) {
+		for (i = 0; i < nr; i++)
+			if (t[i].pid == pid)
+				t[i].status = status;
+	}
+
+	return -1;
+}
+
+/* Print the outcome of each target, return the exit code of the run */
+static int report_targets(const struct target *t, int nr)
+{
+	int i, ret = EXIT_SUCCESS;
+
+	for (i = 0; i < nr; i++) {
+		printf("%s: %s: ", t[i].device, t[i].filename);
+		if (t[i].error)
+			printf("%s\n", t[i].error);
+		else if (WIFEXITED(t[i].status) && !WEXITSTATUS(t[i].status))
+			printf("ok\n");
+		else if (WIFEXITED(t[i].status))
+			printf("failed (exit %d)\n", WEXITSTATUS(t[i].status));
+		else
+			printf("failed (signal %d)\n", WTERMSIG(t[i].status));
+
+		if (t[i].error || !WIFEXITED(t[i].status) ||
+		    WEXITSTATUS(t[i].status))
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
+
+/* Hand the flash back to the FPGA once we are done with it */
+static void release_flash(void)
+{
+	int ret;
+
+	stats_begin(STATS_HANDOVER);
+	usleep(10000);
+
+	// Remove the spi_rockchip module
+	ret = DELETE_MODULE("spi_rockchip", O_TRUNC);
+	if (ret != 0)
+		log_verbose("rmmod failed with return code: %d\n", ret);
+
+	// Toggle the SPI flash access to the FPGA
+	flash_access_to_fpga();
+	stats_end();
 }
 
 /**
@@ -131,74 +762,218 @@ int is_module_loaded(const char *module_name) {
  * ensuring the necessary permissions, loading the required kernel module,
  * and toggling the SPI flash access between the processor and FPGA if needed.
  *
+ * Each attempt reloads spi_rockchip and waits up to FLASH_PROBE_TIMEOUT_MS
+ * for the device node, returning as soon as it shows up.
+ *
  * @param device The path to the MTD device file (e.g., "/dev/mtd0").
  * @return 0 if the configuration is successful, -1 if an error occurs.
  */
-int vicharak_flash_configuration(const char *device) {
+int vicharak_flash_configuration(const char *device)
+{
 	const int max_retries = 10;
+	int retries;
+
+	// Check if the user has root privileges (requires sudo)
+	if (geteuid() != 0) {
+		log_verbose("Please run this program with sudo.\n");
+		return -1;
+	}
+
+	for (retries = 0; retries < max_retries; retries++) {
+		// MTD device file exists
+		if (access(device, F_OK) == 0)
+			return 0;
+
+		// Ensure that flash access is granted to the processor
+		flash_access_to_processor();
+
+		// Attempt to remove the spi_rockchip module
+		if (module_is_loaded("spi_rockchip"))
+			DELETE_MODULE("spi_rockchip", O_TRUNC);
+
+		// Load the spi_rockchip module, through modprobe as a last resort
+		if (module_load("spi_rockchip") < 0 &&
+		    system("modprobe spi_rockchip") != 0)
+			log_verbose("Failed to load spi_rockchip\n");
+
+		if (wait_for_path(device, FLASH_PROBE_TIMEOUT_MS) == 0)
+			return 0;
+	}
+
+	log_verbose("Flash configuration of %s failed after %d retries.\n",
+		    device, max_retries);
+	return -1;
+}
 
-    // Check if the user has root privileges (requires sudo)
-    if (geteuid() != 0) {
-        log_verbose("Please run this program with sudo.\n");
-        return -1;
-    }
+/* cmd-line options, also read by submit_job() */
+static const char short_options[] = "hvd:b:T:pAE:BM:NDK:L:X:I:RJ:Ct::S::c::Vreg:";
+static const struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "device", required_argument, 0, 'd' },
+	{ "backend", required_argument, 0, 'b' },
+	{ "target", required_argument, 0, 'T' },
+	{ "partition", no_argument, 0, 'p' },
+	{ "erase-all", no_argument, 0, 'A' },
+	{ "erase-ahead", required_argument, 0, 'E' },
+	{ "blank-check", no_argument, 0, 'B' },
+	{ "manifest", required_argument, 0, 'M' },
+	{ "no-manifest", no_argument, 0, 'N' },
+	{ "digest", no_argument, 0, 'D' },
+	{ "cache", required_argument, 0, 'K' },
+	{ "verify-lag", required_argument, 0, 'L' },
+	{ "xfer-size", required_argument, 0, 'X' },
+	{ "io-engine", required_argument, 0, 'I' },
+	{ "resume", no_argument, 0, 'R' },
+	{ "journal", required_argument, 0, 'J' },
+	{ "calibrate", no_argument, 0, 'C' },
+	{ "stats", optional_argument, 0, 't' },
+	{ "serve", optional_argument, 0, 'S' },
+	{ "connect", optional_argument, 0, 'c' },
+	{ "version", no_argument, 0, 'V' },
+	{ "read_from_flash", no_argument, 0, 'r' },
+	{ "external_cable", no_argument, 0, 'e' },
+	{ "gpio", required_argument, 0, 'g' },
+	{ 0, 0, 0, 0 },
+};
+
+/* set in the children of the daemon that run a job */
+static int daemon_job;
+
+static int fcp_main(int argc, char *argv[]);
+
+static int run_job(int argc, char *argv[])
+{
+	daemon_job = 1;
+	set_verbose(0);
+	/* restart getopt for the job's own arguments */
+	optind = 0;
+	return fcp_main(argc, argv);
+}
 
-    int retries = 0;
+/* the long option "--@name" stands for, abbreviated as getopt_long() allows */
+static const struct option *find_long_option(const char *name)
+{
+	const struct option *o, *found = NULL;
+	size_t len = strcspn(name, "=");
+
+	for (o = long_options; o->name; o++) {
+		if (strncmp(o->name, name, len))
+			continue;
+		if (strlen(o->name) == len)
+			return o;
+		/* ambiguous */
+		if (found)
+			return NULL;
+		found = o;
+	}
 
-    while (retries < max_retries) {
-        int ret = access(device, F_OK);
+	return found;
+}
 
-        if (ret == 0) {
-            // MTD device file exists
-            return 0;
-        } else {
-            // Ensure that flash access is granted to the processor
-            flash_access_to_processor();
+/*
+ * Send our arguments, less the --connect option, to the daemon. Option
+ * arguments are passed on as they are, and -c is cut out of a cluster of
+ * short options like "-vc" together with its optional argument.
+ */
+static int submit_job(const char *path, int argc, char *argv[])
+{
+	char **args = calloc(argc, sizeof(*args));
+	const struct option *o;
+	const char *spec;
+	char *arg, *opt;
+	int i, n = 0, next;
 
-            // Attempt to remove the spi_rockchip module
-			if (is_module_loaded("spi_rockchip"))
-				DELETE_MODULE("spi_rockchip", O_TRUNC);
+	if (!args)
+		log_failure("Malloc failed");
 
-            // Load the spi_rockchip module
-            system("modprobe spi_rockchip");
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		if (!strcmp(arg, "--")) {
+			while (i < argc)
+				args[n++] = argv[i++];
+			break;
+		}
+		if (arg[0] != '-' || !arg[1]) {
+			args[n++] = arg;
+			continue;
+		}
 
-            sleep(1);
+		if (arg[1] == '-') {
+			o = find_long_option(arg + 2);
+			if (o && o->val == 'c')
+				continue;
+			args[n++] = arg;
+			/* "--name VALUE" */
+			if (o && o->has_arg == required_argument &&
+			    !strchr(arg, '=') && i + 1 < argc)
+				args[n++] = argv[++i];
+			continue;
+		}
 
-            retries++;
-        }
-    }
+		/* the rest of the cluster, or the next argument, is an option's */
+		next = 0;
+		for (opt = arg + 1; *opt && *opt != 'c'; opt++) {
+			spec = strchr(short_options, *opt);
+			if (spec && spec[1] == ':') {
+				next = !opt[1] && spec[2] != ':';
+				opt += strlen(opt);
+				break;
+			}
+		}
+		*opt = '\0';
+		if (opt > arg + 1)
+			args[n++] = arg;
+		if (next && i + 1 < argc)
+			args[n++] = argv[++i];
+	}
 
-    log_failure("Flash configuration failed after %d retries.\n", max_retries);
+	i = daemon_submit(path, n, args);
+	free(args);
+	return i;
 }
 
 int main(int argc, char *argv[])
+{
+	return fcp_main(argc, argv);
+}
+
+static int fcp_main(int argc, char *argv[])
 {
 	const char *filename = NULL, *device = "/dev/mtd0";
-	int i, flags = FLAG_NONE;
-	size_t size, written;
+	/* a daemon job leaves releasing the flash to the daemon */
+	int i, flags = daemon_job ? FLAG_WORKER : FLAG_NONE;
+	const char *serve_path = NULL, *connect_path = NULL;
+	size_t size, written, blk, blen;
 	struct mtd_info_user mtd;
 	struct erase_info_user erase;
-	struct stat filestat;
-	unsigned char *src, *dest;
+	struct erase_map erase_map;
+	struct eraser eraser;
+	struct verifier verifier;
+	unsigned int verify_lag = 0;
+	struct write_ctx wctx = { .device = NULL };
+	struct target targets[MAX_TARGETS];
+	int nr_targets = 0;
+	char *sep;
+	unsigned int erase_ahead = ERASE_AHEAD_DEFAULT;
+	uint32_t xfer = 0, rd;
+	const char *manifest_path = NULL;
+	const char *journal_path = NULL;
+	const char *io_engine = "sync";
+	const char *backend = NULL;
+	struct uring ring = { .fd = -1 };
+	char default_manifest[256];
+	char default_journal[256];
+	int blank_check;
+	unsigned char *dest;
+	uint64_t start;
 	int ret;
-	char *bin_filename = NULL;
 
 	/*********************
 	 * parse cmd-line
 	 *****************/
 	for (;;) {
 		int option_index = 0;
-		static const char *short_options = "hvpAVre";
-		static const struct option long_options[] = {
-			{ "help", no_argument, 0, 'h' },
-			{ "verbose", no_argument, 0, 'v' },
-			{ "partition", no_argument, 0, 'p' },
-			{ "erase-all", no_argument, 0, 'A' },
-			{ "version", no_argument, 0, 'V' },
-			{ "read_from_flash", no_argument, 0, 'r' },
-			{ "external_cable", no_argument, 0, 'e' },
-			{ 0, 0, 0, 0 },
-		};
 
 		int c = getopt_long(argc, argv, short_options, long_options,
 				    &option_index);
@@ -215,6 +990,35 @@ int main(int argc, char *argv[])
 			set_verbose(1);
 			DEBUG("Got FLAG_VERBOSE\n");
 			break;
+		case 'd':
+			device = optarg;
+			DEBUG("Got device: %s\n", device);
+			break;
+		case 'b':
+			backend = optarg;
+			if (!flash_backend(backend, NULL))
+				log_failure("Unknown flash backend %s\n", backend);
+			DEBUG("Got backend: %s\n", backend);
+			break;
+		case 'T':
+			sep = strchr(optarg, ':');
+			if (!sep || sep == optarg || !sep[1])
+				log_failure("Invalid target %s, expected DEVICE:FILE\n",
+					    optarg);
+			if (nr_targets == MAX_TARGETS)
+				log_failure("At most %d targets are supported\n",
+					    MAX_TARGETS);
+			*sep = '\0';
+			for (i = 0; i < nr_targets; i++)
+				if (same_device(targets[i].device, optarg))
+					log_failure("Device %s is given twice\n",
+						    optarg);
+			targets[nr_targets].device = optarg;
+			targets[nr_targets].filename = sep + 1;
+			targets[nr_targets].error = NULL;
+			DEBUG("Got target: %s %s\n", optarg, sep + 1);
+			nr_targets++;
+			break;
 		case 'p':
 			flags |= FLAG_PARTITION;
 			DEBUG("Got FLAG_PARTITION");
@@ -223,20 +1027,96 @@ int main(int argc, char *argv[])
 			flags |= FLAG_ERASE_ALL;
 			DEBUG("Got FLAG_ERASE_ALL\n");
 			break;
+		case 'E':
+			erase_ahead = strtoul(optarg, NULL, 0);
+			DEBUG("Got erase ahead: %u\n", erase_ahead);
+			break;
+		case 'B':
+			flags |= FLAG_BLANK_CHECK;
+			DEBUG("Got FLAG_BLANK_CHECK\n");
+			break;
+		case 'M':
+			manifest_path = optarg;
+			DEBUG("Got manifest: %s\n", manifest_path);
+			break;
+		case 'N':
+			flags |= FLAG_NO_MANIFEST;
+			DEBUG("Got FLAG_NO_MANIFEST\n");
+			break;
+		case 'D':
+			flags |= FLAG_DIGEST;
+			DEBUG("Got FLAG_DIGEST\n");
+			break;
+		case 'L':
+			flags |= FLAG_VERIFY_LAG;
+			verify_lag = strtoul(optarg, NULL, 0);
+			DEBUG("Got verify lag: %u\n", verify_lag);
+			break;
+		case 'K':
+			cache.limit = strcmp(optarg, "0") ? xfer_parse(optarg) : 0;
+			if (!cache.limit && strcmp(optarg, "0"))
+				log_failure("Invalid cache size %s\n", optarg);
+			DEBUG("Got cache size: %llu\n",
+			      (unsigned long long)cache.limit);
+			break;
+		case 'X':
+			xfer = xfer_parse(optarg);
+			if (!xfer)
+				log_failure("Invalid transfer size %s\n", optarg);
+			DEBUG("Got transfer size: %u\n", xfer);
+			break;
+		case 'I':
+			io_engine = optarg;
+			if (strcmp(io_engine, "sync") &&
+			    strcmp(io_engine, "uring"))
+				log_failure("Unknown I/O engine %s\n", io_engine);
+			DEBUG("Got I/O engine: %s\n", io_engine);
+			break;
+		case 'R':
+			flags |= FLAG_RESUME;
+			DEBUG("Got FLAG_RESUME\n");
+			break;
+		case 'J':
+			journal_path = optarg;
+			DEBUG("Got journal: %s\n", journal_path);
+			break;
+		case 'C':
+			flags |= FLAG_CALIBRATE;
+			DEBUG("Got FLAG_CALIBRATE\n");
+			break;
+		case 't':
+			if (optarg && strcmp(optarg, "json") &&
+			    strcmp(optarg, "text"))
+				log_failure("Unknown stats format %s\n", optarg);
+			stats_enable(optarg && !strcmp(optarg, "json"));
+			DEBUG("Got stats: %s\n", optarg ? optarg : "text");
+			break;
+		case 'S':
+			serve_path = optarg ? optarg : DAEMON_SOCKET;
+			DEBUG("Got serve: %s\n", serve_path);
+			break;
+		case 'c':
+			connect_path = optarg ? optarg : DAEMON_SOCKET;
+			DEBUG("Got connect: %s\n", connect_path);
+			break;
 		case 'V':
 			printf("%s: Version: %s\n", PROGRAM_NAME, VERSION);
 			exit(EXIT_SUCCESS);
 			break;
 		case 'r':
-			gpio_set_value(RESET_GPIO, "1");
-			gpio_set_value(CONDONE_GPIO, "1");
+			flash_access_to_fpga();
 			exit(EXIT_SUCCESS);
 			break;
 		case 'e':
-			gpio_set_value(RESET_GPIO, "0");
-			gpio_set_value(CONDONE_GPIO, "0");
+			flash_access_to_processor();
 			exit(EXIT_SUCCESS);
 			break;
+		case 'g':
+			if (gpiocdev_configure(optarg) < 0)
+				log_failure("Invalid GPIO lines %s, expected CHIP:RESET,CONDONE\n",
+					    optarg);
+			DEBUG("Got GPIO lines: %s\n", optarg);
+			break;
 		default:
 			DEBUG("Unknown parameter: %s\n", argv[option_index]);
 			show_usage();
@@ -248,189 +1128,359 @@ int main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 
-	if (optind + 1 == argc) {
-		ret = vicharak_flash_configuration(device);
-		if (ret < 0)
-			log_failure("vicharak_flash_configuration failed\n");
+	if (daemon_job && (serve_path || connect_path))
+		log_failure("Options --serve and --connect are not valid in a job\n");
+
+	if (connect_path)
+		exit(submit_job(connect_path, argc, argv));
+
+	if (serve_path) {
+		if (geteuid() != 0)
+			log_failure("Please run the daemon with sudo.\n");
+		daemon_serve(serve_path, run_job, release_flash);
+	}
 
+	if (optind + 1 == argc) {
 		flags |= FLAG_FILENAME;
 		filename = argv[optind];
 		DEBUG("Got filename: %s\n", filename);
-		bin_filename = malloc(strlen(filename) + 5);
-		snprintf(bin_filename, strlen(filename) + 5, "%s.bin",
-			 filename);
-
-		flags |= FLAG_DEVICE;
 	}
 
+	if (nr_targets && flags & (FLAG_FILENAME | FLAG_CALIBRATE))
+		log_failure("Option --target does not take a FILE or --calibrate\n");
+
 	if (flags & FLAG_PARTITION && flags & FLAG_ERASE_ALL)
 		log_failure(
 			"Option --partition does not support --erase-all\n");
 
-	atexit(cleanup);
-
-	// Convert the provided hexfile to binary
-	if (flags & FLAG_FILENAME) {
-		ret = convert_to_bin(filename, bin_filename);
+	if (flags & (FLAG_FILENAME | FLAG_CALIBRATE) &&
+	    flash_backend(backend, device)->bringup) {
+		stats_begin(STATS_BRINGUP);
+		ret = vicharak_flash_configuration(device);
 		if (ret < 0)
-			log_failure("Convert to binary problem.\n");
+			log_failure("vicharak_flash_configuration failed\n");
+		stats_end();
+
+		flags |= FLAG_DEVICE;
+		daemon_hold();
 	}
 
-	/* get some info about the flash device */
-	dev_fd = safe_open(device, O_SYNC | O_RDWR);
-	if (ioctl(dev_fd, MEMGETINFO, &mtd) < 0) {
-		DEBUG("ioctl(): %m\n");
-		log_failure(
-			"This doesn't seem to be a valid MTD flash device!\n");
+	/*
+	 * bring up the flash once for all targets, then one worker each; a
+	 * target that does not come up fails on its own
+	 */
+	if (nr_targets) {
+		stats_begin(STATS_BRINGUP);
+		for (i = 0; i < nr_targets; i++) {
+			if (!flash_backend(backend, targets[i].device)->bringup)
+				continue;
+			if (vicharak_flash_configuration(targets[i].device) < 0) {
+				targets[i].error = "bring-up failed";
+				continue;
+			}
+			flags |= FLAG_DEVICE;
+			daemon_hold();
+		}
+		stats_end();
+
+		i = spawn_targets(targets, nr_targets);
+		if (i < 0) {
+			ret = report_targets(targets, nr_targets);
+			/* like a single --partition run, keep the flash */
+			if (flags & FLAG_DEVICE &&
+			    !(flags & (FLAG_PARTITION | FLAG_WORKER)))
+				release_flash();
+			exit(ret);
+		}
+
+		device = targets[i].device;
+		filename = targets[i].filename;
+		flags |= FLAG_FILENAME | FLAG_WORKER;
+		set_log_lines(1);
+	}
+	wctx.device = device;
+	stats_label(device, filename);
+
+	atexit(exit_cleanup);
+
+	// Decode the provided hexfile into memory
+	if (!(flags & (FLAG_FILENAME | FLAG_CALIBRATE)))
+		log_failure("No filename specified\n");
+
+	if (flags & FLAG_FILENAME) {
+		stats_begin(STATS_CONVERT);
+		start = stats_start();
+		if (cache_lookup(&cache, filename, &image, &image_size) == 0) {
+			image_mapped = 1;
+			log_verbose("Using the cached image of %s\n", filename);
+		} else {
+			ret = convert_to_buffer(filename, &image, &image_size,
+						&image_mapped);
+			if (ret < 0)
+				log_failure("Convert to binary problem.\n");
+			/* a binary image is used in place, nothing to cache */
+			if (image_mapped)
+				cache.key[0] = '\0';
+		}
+		/* one operation, for the decoded size and throughput */
+		stats_op(image_size, start, 0);
+		stats_end();
 	}
 
-	/* get some info about the file we want to copy */
-	fil_fd = safe_open(bin_filename, O_RDONLY);
-	if (fstat(fil_fd, &filestat) < 0)
-		log_failure("While trying to get the file status of %s: %m\n",
-			    bin_filename);
+	/* get some info about the flash device */
+	flash_open(&dev, backend, device);
+	mtd = dev.info;
 
 	/* does it fit into the device/partition? */
-	if (filestat.st_size > mtd.size)
-		log_failure("%s won't fit into %s!\n", bin_filename, device);
+	if (image_size > mtd.size)
+		log_failure("%s won't fit into %s!\n", filename, device);
+
+	if (flags & FLAG_CALIBRATE) {
+		xfer = xfer_calibrate(&dev);
+		if (xfer_save(xfer, device, &mtd) < 0)
+			log_verbose("Failed to save %s\n", XFER_CONF);
+		if (!(flags & FLAG_FILENAME))
+			goto RELEASE;
+	} else if (xfer) {
+		xfer = xfer_align(xfer, &mtd);
+	} else if (xfer_load(&xfer, device, &mtd) < 0) {
+		xfer = mtd.erasesize;
+	}
+	rd = xfer_read_size(xfer, &mtd);
+	log_verbose("Transfer size: %u bytes\n", xfer);
 
-	src = malloc(mtd.erasesize);
-	if (!src)
-		log_failure("Malloc failed");
+	if (!strcmp(io_engine, "uring") && !dev.direct)
+		log_verbose("The %s backend does not support io_uring, using read()/write()\n",
+			    dev.ops->name);
+	else if (!strcmp(io_engine, "uring") &&
+		 uring_init(&ring, URING_DEPTH) < 0)
+		log_verbose("io_uring is not available, using read()/write()\n");
 
-	dest = malloc(mtd.erasesize);
+	dest = malloc(rd);
 	if (!dest)
 		log_failure("Malloc failed");
 
+	/* the verify and diff passes compare flash against these */
+	if (cache_digests(&cache, &digests, &mtd) < 0 &&
+	    manifest_build(&digests, image, image_size, &mtd) < 0)
+		log_failure("Malloc failed");
+	if (cache_store(&cache, image, image_size, &digests) < 0)
+		log_verbose("Failed to cache the image of %s\n", filename);
+	if (flags & FLAG_DIGEST)
+		manifest_print(&digests, filename);
+
+	/*
+	 * with --no-manifest it is neither used nor saved, but still dropped
+	 * below: once the flash changes it no longer describes it
+	 */
+	if (!manifest_path) {
+		manifest_default_path(default_manifest,
+				      sizeof(default_manifest), device);
+		manifest_path = default_manifest;
+	}
+
 	/* diff block flashcp */
 	if (flags & FLAG_PARTITION) {
 		goto DIFF_BLOCKS;
 	}
 
+	/* pick up where an interrupted flash of this image stopped */
+	if (!journal_path) {
+		journal_default_path(default_journal, sizeof(default_journal),
+				     device);
+		journal_path = default_journal;
+	}
+	ret = journal_open(&journal, journal_path, &digests,
+			   flags & FLAG_RESUME);
+	if (ret < 0) {
+		log_verbose("Failed to open journal %s: %m\n", journal_path);
+	} else if (ret > 0 && dev.nr_regions) {
+		log_verbose("Cannot resume on a flash with erase regions, starting over\n");
+	} else if (ret > 0) {
+		stats_begin(STATS_VERIFY);
+		log_verbose("Checking the %lluk written before\n",
+			    KB((unsigned long long)journal.rec.written));
+		wctx.base = resume_point(journal.rec.written, dest, rd);
+		stats_end();
+		log_verbose("Resuming at %lluk of %lluk\n",
+			    KB((unsigned long long)wctx.base),
+			    KB((unsigned long long)image_size));
+		journal_update(&journal, 0, wctx.base);
+	} else if (flags & FLAG_RESUME) {
+		log_verbose("Nothing to resume on %s, flashing from the start\n",
+			    device);
+	}
+
 	/*****************************************************
 	 * erase enough blocks so that we can write the file *
 	 *****************************************************/
 
-#warning "Check for smaller erase regions"
-
-	erase.start = 0;
-
-	if (flags & FLAG_ERASE_ALL) {
-		erase.length = mtd.size;
-	} else {
-		erase.length =
-			(filestat.st_size + mtd.erasesize - 1) / mtd.erasesize;
-		erase.length *= mtd.erasesize;
-	}
-
-	if (get_verbose()) {
+	manifest_invalidate(manifest_path);
+
+	stats_begin(STATS_ERASE);
+	/* only round up to the erase block size of the region it ends in */
+	if (erase_map_build(&erase_map, &dev, wctx.base,
+			    (flags & FLAG_ERASE_ALL ? mtd.size : image_size) -
+				    wctx.base) < 0)
+		log_failure("Failed to map the erase regions of %s\n", device);
+
+	/* blocks the interrupted run erased may still be blank */
+	blank_check = flags & FLAG_BLANK_CHECK ||
+		      (journal.fd >= 0 && journal.rec.erased > wctx.base);
+
+	if (erase_ahead || blank_check) {
+		/* erase in the background, a few blocks ahead of the writes */
+		eraser_start(&eraser, &dev, &erase_map,
+			     erase_ahead * mtd.erasesize, blank_check);
+		wctx.eraser = &eraser;
+
+		/* blank check without erase-ahead: finish erasing up front */
+		if (!erase_ahead) {
+			log_verbose("Erasing blocks\n");
+			check_eraser(&eraser, eraser_finish(&eraser));
+			wctx.eraser = NULL;
+		}
+	} else if (get_verbose()) {
 		/* if the user wants verbose output, erase 1 block at a time and show him/her what's going on */
-		int blocks = erase.length / mtd.erasesize;
-		erase.length = mtd.erasesize;
+		int blocks = erase_map_blocks(&erase_map), done = 0;
+		unsigned int x;
+
 		log_verbose("Erasing blocks: 0/%d (0%%)", blocks);
-		for (i = 1; i <= blocks; i++) {
-			log_verbose("\rErasing blocks: %d/%d (%d%%)", i, blocks,
-				    PERCENTAGE(i, blocks));
-			safe_memerase(dev_fd, device, &erase);
-			erase.start += mtd.erasesize;
+		for (x = 0; x < erase_map.nr; x++) {
+			erase.length = erase_map.ext[x].unit;
+			for (erase.start = erase_map.ext[x].start;
+			     erase.start < erase_map.ext[x].start +
+						   erase_map.ext[x].length;
+			     erase.start += erase.length) {
+				done++;
+				log_verbose("\rErasing blocks: %d/%d (%d%%)",
+					    done, blocks,
+					    PERCENTAGE(done, blocks));
+				flash_erase(&dev, erase.start, erase.length);
+			}
 		}
 		log_verbose("\rErasing blocks: %d/%d (100%%)\n", blocks,
 			    blocks);
 	} else {
-		/* if not, erase the whole chunk in one shot */
-		safe_memerase(dev_fd, device, &erase);
+		/* if not, erase each region's share of the range in one shot */
+		erase_map_erase(&erase_map, &dev, erase_map.start,
+				erase_map.end - erase_map.start);
+	}
+	stats_end();
+	if (!wctx.eraser) {
+		wctx.erased = erase_map.end;
+		journal_update(&journal, wctx.erased, wctx.base);
+		journal_sync(&journal);
 	}
-	DEBUG("Erased %u / %luk bytes\n", erase.length, filestat.st_size);
+	DEBUG("Erased %u / %luk bytes\n", erase_map.end, image_size);
 
 	/**********************************
 	 * write the entire file to flash *
 	 **********************************/
 
-	log_verbose("Writing data: 0k/%lluk (0%%)",
-		    KB((unsigned long long)filestat.st_size));
-	size = filestat.st_size;
-	i = mtd.erasesize;
-	written = 0;
-	while (size) {
-		if (size < mtd.erasesize)
-			i = size;
-		log_verbose("\rWriting data: %dk/%lluk (%llu%%)",
-			    KB(written + i),
-			    KB((unsigned long long)filestat.st_size),
-			    PERCENTAGE((unsigned long long)written + i,
-				       (unsigned long long)filestat.st_size));
-
-		/* read from filename */
-		safe_read(fil_fd, bin_filename, src, i);
-
-		/* write to device */
-		safe_write(dev_fd, src, i, written,
-			   (unsigned long long)filestat.st_size, device);
-
-		written += i;
-		size -= i;
+	if (flags & FLAG_VERIFY_LAG) {
+		verifier_start(&verifier, &dev, image, &digests,
+			       verify_lag, rd);
+		wctx.verifier = &verifier;
 	}
+
+	stats_begin(STATS_WRITE);
+	log_verbose("Writing data: 0k/%lluk (0%%)",
+		    KB((unsigned long long)image_size));
+	if (ring.fd >= 0)
+		write_uring(&ring, &wctx, xfer);
+	else
+		write_sync(&wctx, xfer);
 	log_verbose("\rWriting data: %lluk/%lluk (100%%)\n",
-		    KB((unsigned long long)filestat.st_size),
-		    KB((unsigned long long)filestat.st_size));
-	DEBUG("Wrote %d / %lluk bytes\n", written,
-	      (unsigned long long)filestat.st_size);
+		    KB((unsigned long long)image_size),
+		    KB((unsigned long long)image_size));
+	stats_end();
+
+	/* with --erase-all there may be blocks left past the image */
+	if (wctx.eraser) {
+		if (eraser.erased < erase_map.end)
+			log_verbose("Erasing remaining blocks\n");
+		stats_begin(STATS_ERASE);
+		check_eraser(&eraser, eraser_finish(&eraser));
+		stats_end();
+	}
+	erase_map_free(&erase_map);
+
+	if (blank_check) {
+		log_verbose("Blank check: skipped %u of %u block erases",
+			    eraser.nr_skipped,
+			    eraser.nr_skipped + eraser.nr_erased);
+		/* estimate the saving from the erases that did happen */
+		if (eraser.nr_erased)
+			log_verbose(", saved ~%llu ms",
+				    (unsigned long long)(eraser.erase_ns /
+							 eraser.nr_erased *
+							 eraser.nr_skipped /
+							 1000000));
+		log_verbose("\n");
+	}
+	DEBUG("Wrote %lluk bytes\n", (unsigned long long)image_size);
 
 	/**********************************
 	 * verify that flash == file data *
 	 **********************************/
 
-	safe_rewind(fil_fd, bin_filename);
-	safe_rewind(dev_fd, device);
-	size = filestat.st_size;
-	i = mtd.erasesize;
+	stats_begin(STATS_VERIFY);
 	written = 0;
-	log_verbose("Verifying data: 0k/%lluk (0%%)",
-		    KB((unsigned long long)filestat.st_size));
-	while (size) {
-		if (size < mtd.erasesize)
-			i = size;
-		log_verbose("\rVerifying data: %luk/%lluk (%llu%%)",
-			    KB(written + i),
-			    KB((unsigned long long)filestat.st_size),
-			    PERCENTAGE((unsigned long long)written + i,
-				       (unsigned long long)filestat.st_size));
-
-		/* read from filename */
-		safe_read(fil_fd, bin_filename, src, i);
+	if (wctx.verifier) {
+		log_verbose("Verifying data\n");
+		/* from a block that read back wrong on, verify and repair below */
+		written = verifier_finish(&verifier);
+	} else if (ring.fd >= 0) {
+		log_verbose("Verifying data: 0k/%lluk (0%%)",
+			    KB((unsigned long long)image_size));
+		verify_uring(&ring, device, rd);
+		log_verbose("\rVerifying data: %lluk/%lluk (100%%)\n",
+			    KB((unsigned long long)image_size),
+			    KB((unsigned long long)image_size));
+		written = image_size;
+	}
+	if (written < image_size) {
+		size = image_size - written;
+		i = rd;
+		verify_progress(written);
+		while (size) {
+			if (size < rd)
+				i = size;
+			verify_progress(written + i);
 
-		/* read from device */
-		safe_read(dev_fd, device, dest, i);
+			/* read from device */
+			flash_read(&dev, dest, i, written);
 
-		/* compare buffers */
-		if (memcmp(src, dest, i))
-			log_failure(
-				"File does not seem to match flash data. First mismatch at 0x%.8zx-0x%.8zx\n",
-				written, written + i);
+			/* compare digests, find the exact byte if they differ */
+			verify_chunk(dest, written, i);
 
-		written += i;
-		size -= i;
+			written += i;
+			size -= i;
+		}
+		log_verbose("\rVerifying data: %lluk/%lluk (100%%)\n",
+			    KB((unsigned long long)image_size),
+			    KB((unsigned long long)image_size));
 	}
-	log_verbose("\rVerifying data: %lluk/%lluk (100%%)\n",
-		    KB((unsigned long long)filestat.st_size),
-		    KB((unsigned long long)filestat.st_size));
+	stats_end();
 	DEBUG("Verified %d / %lluk bytes\n", written,
-	      (unsigned long long)filestat.st_size);
+	      (unsigned long long)image_size);
 
-	// Cleanup device handler and file handler
-	cleanup();
-	usleep(10000);
+	/* nothing left to resume */
+	journal_done(&journal);
 
-	// Remove the spi_rockchip module
-	ret = DELETE_MODULE("spi_rockchip", O_TRUNC);
-	if (ret != 0)
-		log_verbose("rmmod failed with return code: %d\n", ret);
+	if (!(flags & FLAG_NO_MANIFEST))
+		save_manifest(manifest_path);
 
-	// Toggle the SPI flash access to the FPGA
-	flash_access_to_fpga();
+	uring_exit(&ring);
 
-	// Free memory allocated to the file
-	free(bin_filename);
+RELEASE:
+	// Cleanup device handler and file handler
+	cleanup();
+
+	/* with several targets the parent releases the flash for all */
+	if (flags & FLAG_DEVICE && !(flags & FLAG_WORKER))
+		release_flash();
 
 	exit(EXIT_SUCCESS);
 
@@ -438,18 +1488,33 @@ int main(int argc, char *argv[])
 	 * Copy different blocks from file to device *
 	 ********************************************/
 DIFF_BLOCKS:
-	safe_rewind(fil_fd, bin_filename);
-	safe_rewind(dev_fd, device);
-	size = filestat.st_size;
+	size = image_size;
 	i = mtd.erasesize;
-	erase.start = 0;
-	erase.length = (filestat.st_size + mtd.erasesize - 1) / mtd.erasesize;
-	erase.length *= mtd.erasesize;
 	written = 0;
-	unsigned long current_dev_block = 0;
-	int diffBlock = 0;
-	int blocks = erase.length / mtd.erasesize;
-	erase.length = mtd.erasesize;
+	int diffBlock = 0, trusted = 0, eraseFree = 0, readback;
+	int blocks = (image_size + mtd.erasesize - 1) / mtd.erasesize;
+	/* part of the flash held in dest, read ahead in rd sized chunks */
+	size_t cached = 0, cached_len = 0;
+	uint32_t n;
+	uint8_t *check = malloc(mtd.erasesize);
+
+	if (!check)
+		log_failure("Malloc failed");
+
+	if (erase_map_build(&erase_map, &dev, 0, image_size) < 0)
+		log_failure("Failed to map the erase regions of %s\n", device);
+
+	stats_begin(STATS_DIFF);
+	/* blocks whose checksum matches the manifest need no readback */
+	struct manifest manifest = { .crc = NULL };
+	if (!(flags & FLAG_NO_MANIFEST) &&
+	    manifest_load(&manifest, manifest_path, &mtd) == 0 &&
+	    manifest_check(&manifest, &digests, &dev) < 0) {
+		log_verbose("Manifest %s is stale, reading back every block\n",
+			    manifest_path);
+		manifest_free(&manifest);
+	}
+	manifest_invalidate(manifest_path);
 
 	log_verbose("\rProcessing blocks: 0/%d (%d%%)", blocks,
 		    PERCENTAGE(0, blocks));
@@ -459,43 +1524,78 @@ DIFF_BLOCKS:
 		log_verbose("\rProcessing blocks: %d/%d (%d%%)", s, blocks,
 			    PERCENTAGE(s, blocks));
 
-		/* read from filename */
-		safe_read(fil_fd, bin_filename, src, i);
+		if (manifest_trusts(&manifest, s - 1)) {
+			trusted++;
+			goto next_block;
+		}
 
-		/* read from device */
-		current_dev_block = safe_lseek(dev_fd, 0, SEEK_CUR, device);
-		safe_read(dev_fd, device, dest, i);
+		/*
+		 * read from device, together with the following blocks that
+		 * need it too; a block the manifest says changed is rewritten
+		 * without looking
+		 */
+		readback = diff_needs_read(&manifest, s - 1);
+		if (readback && written + i > cached + cached_len) {
+			cached = written;
+			cached_len = i;
+			for (n = s; n < digests.nr_blocks &&
+				    diff_needs_read(&manifest, n) &&
+				    cached_len + manifest_block_len(&digests, n) <= rd;
+			     n++)
+				cached_len += manifest_block_len(&digests, n);
+			flash_read(&dev, dest, cached_len, cached);
+		}
 
 		/* compare buffers, if not the same, erase and write the block */
-		if (memcmp(src, dest, i)) {
+		if (!readback ||
+		    memcmp(image + written, dest + (written - cached), i)) {
 			diffBlock++;
-			/* erase block */
-			safe_lseek(dev_fd, current_dev_block, SEEK_SET, device);
-			safe_memerase(dev_fd, device, &erase);
+			/*
+			 * erase block, unless the new data only clears bits,
+			 * which NOR flash can program directly
+			 */
+			if (readback && mtd.flags & MTD_BIT_WRITEABLE &&
+			    is_programmable(dest + (written - cached),
+					    image + written, i))
+				eraseFree++;
+			else
+				erase_map_erase(&erase_map, &dev, written, i);
 
 			/* write to device */
-			safe_lseek(dev_fd, current_dev_block, SEEK_SET, device);
-			safe_write(dev_fd, src, i, written,
-				   (unsigned long long)filestat.st_size,
-				   device);
+			for (blk = 0; blk < (size_t)i; blk += blen) {
+				blen = i - blk < xfer ? i - blk : xfer;
+				flash_program(&dev, image + written + blk,
+					      blen, written + blk);
+			}
 
 			/* read from device */
-			safe_lseek(dev_fd, current_dev_block, SEEK_SET, device);
-			safe_read(dev_fd, device, dest, i);
+			flash_read(&dev, check, i, written);
 
 			/* compare buffers for write success */
-			if (memcmp(src, dest, i))
+			if (memcmp(image + written, check, i) &&
+			    repair_block(written, i) < 0)
 				log_failure(
 					"File does not seem to match flash data. First mismatch at 0x%.8zx-0x%.8zx\n",
 					written, written + i);
 		}
 
-		erase.start += i;
+next_block:
 		written += i;
 		size -= i;
 	}
-
-	log_verbose("\ndiff blocks: %d\n", diffBlock);
+	stats_end();
+
+	log_verbose("\ndiff blocks: %d (%d erased, %d erase-free)\n",
+		    diffBlock, diffBlock - eraseFree, eraseFree);
+	if (manifest.crc)
+		log_verbose("blocks matched by manifest: %d\n", trusted);
+
+	if (!(flags & FLAG_NO_MANIFEST))
+		save_manifest(manifest_path);
+	manifest_free(&manifest);
+	erase_map_free(&erase_map);
+	free(check);
+	uring_exit(&ring);
 
 	exit(EXIT_SUCCESS);
 }
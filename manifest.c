@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Sidecar manifest of per block checksums. The file is a fixed header,
+ * one CRC32C per erase block and a CRC32C of everything before it.
+ */
+
+#include "flashcp.h"
+#include "crc32c.h"
+#include "manifest.h"
+#include <libgen.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct manifest_header {
+	char magic[8];
+	uint32_t erasesize;
+	uint32_t nr_blocks;
+	uint64_t mtd_size;
+	uint64_t image_size;
+};
+
+void manifest_default_path(char *path, size_t len, const char *device)
+{
+	char *copy = strdup(device);
+
+	snprintf(path, len, "%s/%s.manifest", MANIFEST_DIR,
+		 copy ? basename(copy) : "mtd");
+	free(copy);
+}
+
+/**
+ * @brief Compute the per block and whole image checksums of @p image.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int manifest_build(struct manifest *m, const uint8_t *image, size_t size,
+		   const struct mtd_info_user *mtd)
+{
+	uint32_t i;
+
+	m->erasesize = mtd->erasesize;
+	m->mtd_size = mtd->size;
+	m->image_size = size;
+	m->nr_blocks = (size + mtd->erasesize - 1) / mtd->erasesize;
+	m->crc = malloc((m->nr_blocks ? m->nr_blocks : 1) * sizeof(*m->crc));
+	if (!m->crc)
+		return -1;
+
+	/* both digests in a single pass over the image */
+	m->image_crc = 0;
+	for (i = 0; i < m->nr_blocks; i++) {
+		const uint8_t *block = image + (size_t)i * m->erasesize;
+		uint32_t len = manifest_block_len(m, i);
+
+		m->crc[i] = crc32c(0, block, len);
+		m->image_crc = crc32c(m->image_crc, block, len);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read a manifest and make sure it describes a device like @p mtd.
+ *
+ * @return 0 on success, -1 if it is missing, corrupt or for another
+ * geometry.
+ */
+int manifest_load(struct manifest *m, const char *path,
+		  const struct mtd_info_user *mtd)
+{
+	struct manifest_header hdr;
+	uint32_t crc, stored;
+	size_t bytes;
+	FILE *fp;
+
+	m->crc = NULL;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.erasesize != mtd->erasesize || hdr.mtd_size != mtd->size ||
+	    hdr.nr_blocks !=
+		    (hdr.image_size + hdr.erasesize - 1) / hdr.erasesize ||
+	    hdr.image_size > hdr.mtd_size)
+		goto err;
+
+	bytes = (size_t)hdr.nr_blocks * sizeof(*m->crc);
+	m->crc = malloc(bytes ? bytes : 1);
+	if (!m->crc || fread(m->crc, 1, bytes, fp) != bytes ||
+	    fread(&stored, sizeof(stored), 1, fp) != 1)
+		goto err;
+
+	crc = crc32c(0, &hdr, sizeof(hdr));
+	crc = crc32c(crc, m->crc, bytes);
+	if (crc != stored)
+		goto err;
+
+	fclose(fp);
+	m->erasesize = hdr.erasesize;
+	m->nr_blocks = hdr.nr_blocks;
+	m->mtd_size = hdr.mtd_size;
+	m->image_size = hdr.image_size;
+	return 0;
+
+err:
+	fclose(fp);
+	manifest_free(m);
+	return -1;
+}
+
+/**
+ * @brief Write @p m to @p path, replacing any previous manifest atomically.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int manifest_save(const struct manifest *m, const char *path)
+{
+	struct manifest_header hdr;
+	size_t bytes = (size_t)m->nr_blocks * sizeof(*m->crc);
+	char *tmp, *dir;
+	uint32_t crc;
+	FILE *fp;
+	int ret = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.erasesize = m->erasesize;
+	hdr.nr_blocks = m->nr_blocks;
+	hdr.mtd_size = m->mtd_size;
+	hdr.image_size = m->image_size;
+	crc = crc32c(0, &hdr, sizeof(hdr));
+	crc = crc32c(crc, m->crc, bytes);
+
+	tmp = malloc(strlen(path) + 5);
+	dir = strdup(path);
+	if (!tmp || !dir)
+		goto out;
+	sprintf(tmp, "%s.tmp", path);
+	mkdir(dirname(dir), 0755);
+
+	fp = fopen(tmp, "wb");
+	if (!fp)
+		goto out;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(m->crc, 1, bytes, fp) != bytes ||
+	    fwrite(&crc, sizeof(crc), 1, fp) != 1 ||
+	    fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+	else
+		ret = 0;
+
+out:
+	free(tmp);
+	free(dir);
+	return ret;
+}
+
+/* block @n of @image is the same as the block @m says is on the flash */
+int manifest_matches(const struct manifest *m, const struct manifest *image,
+		     uint32_t n)
+{
+	return m->crc && n < m->nr_blocks && n < image->nr_blocks &&
+	       manifest_block_len(m, n) == manifest_block_len(image, n) &&
+	       m->crc[n] == image->crc[n];
+}
+
+/**
+ * @brief Cheap check that the flash still holds what the manifest says.
+ *
+ * Of the blocks that writing @p image would skip because of the manifest,
+ * the first and the last and a few random ones are read back and checked
+ * against their checksums, to catch the flash having been written behind
+ * our back without reading back the whole image.
+ *
+ * @return 0 if every sample matched, -1 if the manifest is stale.
+ */
+int manifest_check(const struct manifest *m, const struct manifest *image,
+		   struct flash *f)
+{
+	uint32_t *skipped, nr = 0, n, len;
+	uint8_t *buf;
+	int i, ret = 0;
+
+	skipped = malloc((m->nr_blocks ? m->nr_blocks : 1) * sizeof(*skipped));
+	buf = malloc(m->erasesize);
+	if (!skipped || !buf)
+		log_failure("Malloc failed");
+
+	for (n = 0; n < m->nr_blocks; n++)
+		if (manifest_matches(m, image, n))
+			skipped[nr++] = n;
+
+	srand(time(NULL) ^ getpid());
+	for (i = 0; i < MANIFEST_SAMPLES && nr; i++) {
+		if (i == 0)
+			n = skipped[0];
+		else if (i == 1)
+			n = skipped[nr - 1];
+		else
+			n = skipped[rand() % nr];
+
+		len = manifest_block_len(m, n);
+		flash_read(f, buf, len, (off_t)n * m->erasesize);
+		if (crc32c(0, buf, len) != m->crc[n]) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(buf);
+	free(skipped);
+	return ret;
+}
+
+/* Print the digests in a line oriented form for provisioning records */
+void manifest_print(const struct manifest *m, const char *name)
+{
+	uint32_t i;
+
+	printf("image %s size %llu crc32c %08x\n", name,
+	       (unsigned long long)m->image_size, m->image_crc);
+	for (i = 0; i < m->nr_blocks; i++)
+		printf("block %u offset 0x%.8llx size %u crc32c %08x\n", i,
+		       (unsigned long long)i * m->erasesize,
+		       manifest_block_len(m, i), m->crc[i]);
+	fflush(stdout);
+}
+
+/*
+ * Drop the manifest before touching the flash, so an interrupted run can
+ * never leave one behind that claims the old contents.
+ */
+void manifest_invalidate(const char *path)
+{
+	if (unlink(path) < 0 && errno != ENOENT)
+		log_verbose("Failed to remove %s: %m\n", path);
+}
+
+void manifest_free(struct manifest *m)
+{
+	free(m->crc);
+	m->crc = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mtd/mtd-user.h>
+#include "flash.h"
+
+/* where manifests live unless --manifest points elsewhere */
+#define MANIFEST_DIR "/var/lib/fcp"
+#define MANIFEST_MAGIC "FCPMANI1"
+
+/* blocks read back to make sure a manifest still matches the flash */
+#define MANIFEST_SAMPLES 8
+
+/*
+ * Per erase block CRC32C of the image last written to a device. Lets the
+ * --partition diff mode find changed blocks without reading them back.
+ */
+struct manifest {
+	uint32_t erasesize;
+	uint32_t nr_blocks;
+	uint64_t mtd_size;
+	uint64_t image_size;
+	uint32_t *crc;
+	/* CRC32C of the whole image, only known after manifest_build() */
+	uint32_t image_crc;
+};
+
+void manifest_default_path(char *path, size_t len, const char *device);
+int manifest_build(struct manifest *m, const uint8_t *image, size_t size,
+		   const struct mtd_info_user *mtd);
+int manifest_load(struct manifest *m, const char *path,
+		  const struct mtd_info_user *mtd);
+int manifest_save(const struct manifest *m, const char *path);
+int manifest_matches(const struct manifest *m, const struct manifest *image,
+		     uint32_t n);
+int manifest_check(const struct manifest *m, const struct manifest *image,
+		   struct flash *f);
+void manifest_invalidate(const char *path);
+void manifest_print(const struct manifest *m, const char *name);
+void manifest_free(struct manifest *m);
+
+static inline uint32_t manifest_block_len(const struct manifest *m,
+					  uint32_t block)
+{
+	uint64_t off = (uint64_t)block * m->erasesize;
+
+	return m->image_size - off < m->erasesize ? m->image_size - off :
+						    m->erasesize;
+}
+
+#endif /* MANIFEST_H */
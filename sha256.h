@@ -0,0 +1,12 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+/* SHA-256 (FIPS 180-4) of @len bytes at @buf */
+void sha256(const void *buf, size_t len, uint8_t digest[SHA256_LEN]);
+
+#endif /* SHA256_H */
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Phase timing and block operation latencies, printed at exit as a table
+ * or as a single JSON object per process.
+ */
+
+#include "flashcp.h"
+#include "stats.h"
+#include <pthread.h>
+#include <time.h>
+
+struct phase_stats {
+	/* time the main flow spent in the phase */
+	uint64_t wall_ns;
+	/* lifetime of the longest background thread working on it */
+	uint64_t thread_ns;
+	/* time spent inside block operations, from any thread */
+	uint64_t busy_ns;
+	uint64_t bytes, ops, syscalls;
+
+	/* latency of every block operation */
+	uint64_t *lat;
+	size_t nr_lat, cap_lat;
+};
+
+static const char *const phase_names[STATS_NR_PHASES] = {
+	[STATS_CONVERT] = "convert",
+	[STATS_BRINGUP] = "bringup",
+	[STATS_ERASE] = "erase",
+	[STATS_WRITE] = "write",
+	[STATS_VERIFY] = "verify",
+	[STATS_DIFF] = "diff",
+	[STATS_HANDOVER] = "handover",
+};
+
+static struct phase_stats phases[STATS_NR_PHASES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled, json;
+static const char *label_device, *label_file;
+
+static __thread int cur_phase = -1;
+static __thread uint64_t phase_start;
+static __thread int background;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* @return the start time of an operation, 0 if stats are off */
+uint64_t stats_start(void)
+{
+	return enabled ? now_ns() : 0;
+}
+
+void stats_begin(enum stats_phase phase)
+{
+	if (!enabled)
+		return;
+
+	cur_phase = phase;
+	phase_start = now_ns();
+}
+
+void stats_end(void)
+{
+	uint64_t ns;
+
+	if (!enabled || cur_phase < 0)
+		return;
+
+	ns = now_ns() - phase_start;
+	pthread_mutex_lock(&lock);
+	if (!background)
+		phases[cur_phase].wall_ns += ns;
+	else if (ns > phases[cur_phase].thread_ns)
+		phases[cur_phase].thread_ns = ns;
+	pthread_mutex_unlock(&lock);
+	cur_phase = -1;
+}
+
+/*
+ * Charge the calling background thread's operations to @phase, until it
+ * calls stats_end() before returning.
+ */
+void stats_thread(enum stats_phase phase)
+{
+	background = 1;
+	stats_begin(phase);
+}
+
+/**
+ * @brief Record a block operation of @p bytes that began at @p start.
+ *
+ * @param syscalls System calls the operation took.
+ */
+void stats_op(size_t bytes, uint64_t start, unsigned int syscalls)
+{
+	struct phase_stats *ps;
+	uint64_t ns, *grown;
+
+	if (!enabled || cur_phase < 0)
+		return;
+
+	ns = now_ns() - start;
+	pthread_mutex_lock(&lock);
+	ps = &phases[cur_phase];
+	ps->busy_ns += ns;
+	ps->bytes += bytes;
+	ps->ops++;
+	ps->syscalls += syscalls;
+
+	if (ps->nr_lat == ps->cap_lat) {
+		ps->cap_lat = ps->cap_lat ? ps->cap_lat * 2 : 1024;
+		grown = realloc(ps->lat, ps->cap_lat * sizeof(*ps->lat));
+		if (!grown)
+			ps->cap_lat = ps->nr_lat;
+		else
+			ps->lat = grown;
+	}
+	if (ps->nr_lat < ps->cap_lat)
+		ps->lat[ps->nr_lat++] = ns;
+	pthread_mutex_unlock(&lock);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* @p pct percentile of the sorted latencies, in microseconds */
+static double percentile(const struct phase_stats *ps, int pct)
+{
+	if (!ps->nr_lat)
+		return 0;
+	return ps->lat[(ps->nr_lat - 1) * pct / 100] / 1e3;
+}
+
+/* throughput over the time the phase ran, in the main flow or a thread */
+static double mb_per_s(const struct phase_stats *ps)
+{
+	uint64_t ns = ps->wall_ns > ps->thread_ns ? ps->wall_ns : ps->thread_ns;
+
+	return ns ? ps->bytes * 1e3 / ns : 0;
+}
+
+static void print_string(const char *str)
+{
+	putchar('"');
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void report(void)
+{
+	struct phase_stats *ps;
+	int i, first = 1;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < STATS_NR_PHASES; i++)
+		qsort(phases[i].lat, phases[i].nr_lat, sizeof(uint64_t),
+		      cmp_u64);
+
+	if (json) {
+		printf("{\"device\":");
+		print_string(label_device);
+		printf(",\"file\":");
+		print_string(label_file);
+		printf(",\"phases\":{");
+	} else {
+		printf("\n%-9s %10s %10s %12s %7s %8s %9s %9s %9s %9s %9s\n",
+		       "phase", "wall ms", "busy ms", "bytes", "ops",
+		       "syscalls", "MB/s", "p50 us", "p90 us", "p99 us",
+		       "max us");
+	}
+
+	for (i = 0; i < STATS_NR_PHASES; i++) {
+		ps = &phases[i];
+		if (!ps->wall_ns && !ps->ops)
+			continue;
+
+		if (json) {
+			printf("%s\"%s\":{\"wall_ms\":%.3f,\"busy_ms\":%.3f,"
+			       "\"bytes\":%llu,\"ops\":%llu,\"syscalls\":%llu,"
+			       "\"mb_s\":%.2f,\"latency_us\":{\"p50\":%.1f,"
+			       "\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}}",
+			       first ? "" : ",", phase_names[i],
+			       ps->wall_ns / 1e6, ps->busy_ns / 1e6,
+			       (unsigned long long)ps->bytes,
+			       (unsigned long long)ps->ops,
+			       (unsigned long long)ps->syscalls, mb_per_s(ps),
+			       percentile(ps, 50), percentile(ps, 90),
+			       percentile(ps, 99), percentile(ps, 100));
+		} else {
+			printf("%-9s %10.3f %10.3f %12llu %7llu %8llu %9.2f %9.1f %9.1f %9.1f %9.1f\n",
+			       phase_names[i], ps->wall_ns / 1e6,
+			       ps->busy_ns / 1e6,
+			       (unsigned long long)ps->bytes,
+			       (unsigned long long)ps->ops,
+			       (unsigned long long)ps->syscalls, mb_per_s(ps),
+			       percentile(ps, 50), percentile(ps, 90),
+			       percentile(ps, 99), percentile(ps, 100));
+		}
+		first = 0;
+	}
+
+	if (json)
+		printf("}}\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Start collecting, and print the report when the process exits,
+ * whether it succeeds or not.
+ *
+ * @param as_json Print one JSON object instead of a table.
+ */
+void stats_enable(int as_json)
+{
+	if (!enabled)
+		atexit(report);
+	enabled = 1;
+	json = as_json;
+}
+
+/* Name the device and input file in the JSON report */
+void stats_label(const char *device, const char *file)
+{
+	label_device = device;
+	label_file = file;
+}
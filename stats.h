@@ -0,0 +1,32 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum stats_phase {
+	STATS_CONVERT,
+	STATS_BRINGUP,
+	STATS_ERASE,
+	STATS_WRITE,
+	STATS_VERIFY,
+	STATS_DIFF,
+	STATS_HANDOVER,
+	STATS_NR_PHASES,
+};
+
+/*
+ * Per phase timing for --stats. Phases are tracked per thread: the main
+ * flow brackets each phase with stats_begin()/stats_end(), background
+ * threads pick theirs with stats_thread(), and every block operation is
+ * charged to the phase of the thread that performs it.
+ */
+void stats_enable(int json);
+void stats_label(const char *device, const char *file);
+uint64_t stats_start(void);
+void stats_begin(enum stats_phase phase);
+void stats_end(void);
+void stats_thread(enum stats_phase phase);
+void stats_op(size_t bytes, uint64_t start, unsigned int syscalls);
+
+#endif /* STATS_H */
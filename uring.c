@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * io_uring engine for the device reads and writes. Talks to the kernel
+ * through io_uring_setup()/io_uring_enter() directly, so it needs no
+ * library, and reports failure on kernels that lack it so the caller can
+ * stay on plain read()/write().
+ */
+
+#include "flashcp.h"
+#include "uring.h"
+#include <sys/mman.h>
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int submit, unsigned int wait,
+			      unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * IORING_OP_READ and IORING_OP_WRITE came in 5.6, together with the
+ * probe; older kernels fail the probe and only have the vectored ops.
+ */
+static int uring_probe(int fd)
+{
+	/* room for every opcode the u8 op field can name */
+	const unsigned int nr_ops = 256;
+	struct io_uring_probe *probe;
+	int ret = -1;
+
+	probe = calloc(1, sizeof(*probe) + nr_ops * sizeof(probe->ops[0]));
+	if (!probe)
+		return -1;
+
+	if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+				  nr_ops) == 0 &&
+	    IORING_OP_READ < probe->ops_len &&
+	    IORING_OP_WRITE < probe->ops_len &&
+	    probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED &&
+	    probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+		ret = 0;
+
+	free(probe);
+	return ret;
+}
+
+/**
+ * @brief Set up a ring with room for @p entries requests.
+ *
+ * @return 0 on success, -1 if the kernel has no usable io_uring (it is
+ * missing, disabled, or lacks IORING_OP_READ/IORING_OP_WRITE).
+ */
+int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	if (uring_probe(r->fd) < 0)
+		goto err;
+
+	r->entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto err;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err;
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+/**
+ * @brief Queue a read or write of @p len bytes at offset @p off.
+ *
+ * Nothing reaches the kernel until the next uring_wait(), so a batch of
+ * requests costs a single system call.
+ *
+ * @param data Returned by uring_wait() when the request completes.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int uring_queue(struct uring *r, int write, int fd, const void *buf,
+		size_t len, uint64_t off, uint64_t data)
+{
+	unsigned int tail = *r->sq_tail, index;
+	struct io_uring_sqe *sqe;
+
+	if (r->pending + r->inflight >= r->entries ||
+	    tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+		return -1;
+
+	index = tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	r->sq_array[index] = index;
+
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+	return 0;
+}
+
+/**
+ * @brief Submit the queued requests and wait for one to complete.
+ *
+ * @param data The tag passed to uring_queue() for the completed request.
+ * @param res Its result, bytes transferred or a negative errno.
+ * @return 0 on success, -1 if nothing is outstanding or on error.
+ */
+int uring_wait(struct uring *r, uint64_t *data, int *res)
+{
+	unsigned int head;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	for (;;) {
+		head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			*data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(r->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			r->inflight--;
+			return 0;
+		}
+
+		if (!r->pending && !r->inflight)
+			return -1;
+
+		/* submit the batch and wait for a completion in one call */
+		ret = sys_io_uring_enter(r->fd, r->pending, 1,
+					 IORING_ENTER_GETEVENTS);
+		r->enters++;
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		r->pending -= ret;
+		r->inflight += ret;
+	}
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->fd < 0)
+		return;
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
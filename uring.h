@@ -0,0 +1,39 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* requests kept in flight by the io_uring engine */
+#define URING_DEPTH 8
+
+/*
+ * Minimal io_uring over the raw system calls: reads and writes with
+ * explicit offsets, queued and reaped by the caller.
+ */
+struct uring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* queued but not yet submitted, and submitted but not reaped */
+	unsigned int pending, inflight;
+	/* io_uring_enter() calls so far */
+	unsigned long enters;
+};
+
+int uring_init(struct uring *r, unsigned int entries);
+int uring_queue(struct uring *r, int write, int fd, const void *buf,
+		size_t len, uint64_t off, uint64_t data);
+int uring_wait(struct uring *r, uint64_t *data, int *res);
+void uring_exit(struct uring *r);
+
+#endif /* URING_H */
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ */
+
+#include "flashcp.h"
+#include "crc32c.h"
+#include "verifier.h"
+#include "stats.h"
+
+/*
+ * Compare @len bytes read back at @off with the digests. Returns the
+ * offset of the first block that differs, or @off + @len.
+ */
+static size_t check_chunk(struct verifier *v, const uint8_t *buf, size_t off,
+			  size_t len)
+{
+	size_t blk, blen;
+
+	for (blk = 0; blk < len; blk += blen) {
+		blen = len - blk < v->block ? len - blk : v->block;
+		if (crc32c(0, buf + blk, blen) !=
+		    v->digests->crc[(off + blk) / v->block])
+			return off + blk;
+	}
+
+	return off + len;
+}
+
+/*
+ * Never exits: that would tear down the device and the image under the
+ * writer. A failure only ends the thread, see verifier_finish().
+ */
+static void *verifier_thread(void *arg)
+{
+	struct verifier *v = arg;
+	size_t off, len, need, end;
+	uint8_t *buf;
+
+	stats_thread(STATS_VERIFY);
+	buf = malloc(v->chunk);
+	if (!buf)
+		goto out;
+
+	for (off = 0; off < v->total; off += len) {
+		len = v->total - off < v->chunk ? v->total - off : v->chunk;
+
+		/* wait until the writer is @lag blocks past this chunk */
+		need = off + len + (size_t)(v->lag - 1) * v->block;
+		if (need > v->total)
+			need = v->total;
+
+		pthread_mutex_lock(&v->lock);
+		while (v->written < need)
+			pthread_cond_wait(&v->written_moved, &v->lock);
+		pthread_mutex_unlock(&v->lock);
+
+		if (flash_try_read(v->flash, buf, len, off) != (ssize_t)len) {
+			log_verbose("\nFailed to read back 0x%.8zx-0x%.8zx: %m\n",
+				    off, off + len);
+			break;
+		}
+
+		end = check_chunk(v, buf, off, len);
+		v->verified = end;
+		if (end < off + len) {
+			log_verbose("\nBlock 0x%.8zx does not read back right\n",
+				    end);
+			break;
+		}
+	}
+
+out:
+	free(buf);
+	stats_end();
+	return NULL;
+}
+
+/**
+ * @brief Start verifying the image against the flash behind the writer.
+ *
+ * @param lag Verify block N once the writer has finished block N + lag - 1.
+ * @param chunk Bytes read back per call, a multiple of the erase size.
+ */
+void verifier_start(struct verifier *v, struct flash *f,
+		    const uint8_t *image, const struct manifest *digests,
+		    unsigned int lag, size_t chunk)
+{
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->written_moved, NULL);
+	v->flash = f;
+	v->image = image;
+	v->digests = digests;
+	v->total = digests->image_size;
+	v->block = digests->erasesize;
+	v->chunk = chunk ? chunk : v->block;
+	v->lag = lag ? lag : 1;
+	v->written = 0;
+	v->verified = 0;
+
+	if (pthread_create(&v->thread, NULL, verifier_thread, v))
+		log_failure("Failed to start the verify thread\n");
+}
+
+/* Called by the writer once everything before @p written is on flash */
+void verifier_advance(struct verifier *v, size_t written)
+{
+	pthread_mutex_lock(&v->lock);
+	v->written = written;
+	pthread_cond_signal(&v->written_moved);
+	pthread_mutex_unlock(&v->lock);
+}
+
+/**
+ * @brief Wait for the remaining blocks to be verified.
+ *
+ * @return the end of the part of the image that reads back right: the
+ * image size, or the offset of the block where the verifier stopped, which
+ * the caller verifies again and repairs from there on.
+ */
+size_t verifier_finish(struct verifier *v)
+{
+	verifier_advance(v, v->total);
+
+	pthread_join(v->thread, NULL);
+	pthread_cond_destroy(&v->written_moved);
+	pthread_mutex_destroy(&v->lock);
+
+	return v->verified;
+}
@@ -0,0 +1,39 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "manifest.h"
+#include "flash.h"
+
+/*
+ * Read-after-write verification that trails the write cursor by a few
+ * blocks, so verification finishes right after the last write. The
+ * thread stops at the first block that fails to read back right and
+ * leaves the rest, from that block on, to the main thread.
+ */
+struct verifier {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t written_moved;
+
+	struct flash *flash;
+	const uint8_t *image;
+	const struct manifest *digests;
+	size_t total, block, chunk;
+	unsigned int lag;
+
+	/* bytes written so far, as reported by the writer */
+	size_t written;
+	/* bytes that read back right, up to the first bad block */
+	size_t verified;
+};
+
+void verifier_start(struct verifier *v, struct flash *f,
+		    const uint8_t *image, const struct manifest *digests,
+		    unsigned int lag, size_t chunk);
+void verifier_advance(struct verifier *v, size_t written);
+size_t verifier_finish(struct verifier *v);
+
+#endif /* VERIFIER_H */
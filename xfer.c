@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2023 Vicharak Computer LLP.
+ *
+ * Size of the reads and writes issued to the MTD device. Defaults to one
+ * erase block; --xfer-size overrides it and --calibrate measures the
+ * candidates on the device and remembers the fastest per geometry.
+ */
+
+#include "flashcp.h"
+#include "xfer.h"
+#include <libgen.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* smallest candidate tried by the calibration */
+#define XFER_CALIBRATE_MIN 4096
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Parse a byte count with an optional k or m suffix.
+ *
+ * @return the size in bytes, 0 if @p arg is not a valid size.
+ */
+uint32_t xfer_parse(const char *arg)
+{
+	unsigned long size;
+	char *end;
+
+	size = strtoul(arg, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+
+	if (end == arg || *end || size > UINT32_MAX)
+		return 0;
+	return size;
+}
+
+/**
+ * @brief Round @p size down to something the device can transfer.
+ *
+ * Sizes of at least one erase block become a multiple of the erase size,
+ * smaller ones a multiple of the write size. Never returns less than the
+ * write size or more than the device.
+ */
+uint32_t xfer_align(uint32_t size, const struct mtd_info_user *mtd)
+{
+	uint32_t unit = mtd->writesize ? mtd->writesize : 1;
+
+	if (size > mtd->size)
+		size = mtd->size;
+	if (size >= mtd->erasesize)
+		unit = mtd->erasesize;
+
+	size -= size % unit;
+	return size ? size : unit;
+}
+
+static int xfer_match(const char *line, const char *device,
+		      const struct mtd_info_user *mtd, uint32_t *size)
+{
+	char name[256];
+	unsigned int mtd_size, erasesize, writesize, xfer;
+
+	if (sscanf(line, "%255s %u %u %u %u", name, &mtd_size, &erasesize,
+		   &writesize, &xfer) != 5)
+		return 0;
+	if (strcmp(name, device) || mtd_size != mtd->size ||
+	    erasesize != mtd->erasesize || writesize != mtd->writesize)
+		return 0;
+
+	*size = xfer;
+	return 1;
+}
+
+/**
+ * @brief Look up the calibrated transfer size of @p device.
+ *
+ * @return 0 if one was saved for this device and geometry, -1 otherwise.
+ */
+int xfer_load(uint32_t *size, const char *device,
+	      const struct mtd_info_user *mtd)
+{
+	char line[512];
+	uint32_t xfer;
+	int ret = -1;
+	FILE *fp;
+
+	fp = fopen(XFER_CONF, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (xfer_match(line, device, mtd, &xfer) && xfer) {
+			*size = xfer_align(xfer, mtd);
+			ret = 0;
+		}
+	}
+
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * @brief Remember @p size for @p device, replacing any older entry for
+ * the same geometry.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int xfer_save(uint32_t size, const char *device,
+	      const struct mtd_info_user *mtd)
+{
+	const char *tmp = XFER_CONF ".tmp";
+	char line[512], *dir;
+	uint32_t xfer;
+	FILE *in, *out;
+
+	dir = strdup(XFER_CONF);
+	if (!dir)
+		return -1;
+	mkdir(dirname(dir), 0755);
+	free(dir);
+
+	out = fopen(tmp, "w");
+	if (!out)
+		return -1;
+
+	/* keep the entries of other devices and geometries */
+	in = fopen(XFER_CONF, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in))
+			if (!xfer_match(line, device, mtd, &xfer))
+				fputs(line, out);
+		fclose(in);
+	}
+
+	fprintf(out, "%s %u %u %u %u\n", device, mtd->size, mtd->erasesize,
+		mtd->writesize, size);
+
+	if (fflush(out) || fsync(fileno(out))) {
+		fclose(out);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(out);
+
+	if (rename(tmp, XFER_CONF) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Measure the throughput of each candidate transfer size.
+ *
+ * Reads the start of the device with each size, doubling from 4 KiB up
+ * to XFER_CALIBRATE_SPAN. On NOR flash the same range is also written
+ * with 0xff, which programs no bits and so leaves the contents intact.
+ *
+ * @return the fastest transfer size.
+ */
+uint32_t xfer_calibrate(struct flash *f)
+{
+	const struct mtd_info_user *mtd = &f->info;
+	int writes = mtd->flags & MTD_BIT_WRITEABLE;
+	uint32_t span = xfer_align(XFER_CALIBRATE_SPAN, mtd);
+	uint32_t size, xfer, prev = 0, best = mtd->erasesize;
+	double rate, best_rate = 0;
+	uint64_t start, moved;
+	uint8_t *buf, *ones;
+	uint32_t off;
+
+	buf = malloc(span);
+	ones = malloc(span);
+	if (!buf || !ones)
+		log_failure("Malloc failed");
+	memset(ones, 0xff, span);
+
+	printf("Calibrating transfer size on %s (%s, %u bytes per size)\n",
+	       f->device, writes ? "read and write" : "read only", span);
+
+	for (size = XFER_CALIBRATE_MIN; size <= span; size *= 2) {
+		xfer = xfer_align(size, mtd);
+		if (xfer == prev)
+			continue;
+		prev = xfer;
+
+		moved = 0;
+		start = now_ns();
+		for (off = 0; span - off >= xfer; off += xfer) {
+			flash_read(f, buf, xfer, off);
+			moved += xfer;
+		}
+		if (writes) {
+			for (off = 0; span - off >= xfer; off += xfer) {
+				flash_program(f, ones, xfer, off);
+				moved += xfer;
+			}
+		}
+		start = now_ns() - start;
+
+		rate = start ? moved * 1e3 / start : 0;
+		printf("  %8u bytes %9.2f MB/s\n", xfer, rate);
+
+		/* on a tie keep the smaller size */
+		if (rate > best_rate) {
+			best_rate = rate;
+			best = xfer;
+		}
+	}
+
+	printf("Best transfer size: %u bytes\n", best);
+	fflush(stdout);
+
+	free(buf);
+	free(ones);
+	return best;
+}
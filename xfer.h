@@ -0,0 +1,29 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdint.h>
+#include <mtd/mtd-user.h>
+#include "flash.h"
+
+/* best transfer size found by --calibrate, one line per device geometry */
+#define XFER_CONF "/var/lib/fcp/xfer.conf"
+
+/* bytes moved per candidate size while calibrating */
+#define XFER_CALIBRATE_SPAN (256 * 1024)
+
+uint32_t xfer_parse(const char *arg);
+uint32_t xfer_align(uint32_t size, const struct mtd_info_user *mtd);
+int xfer_load(uint32_t *size, const char *device,
+	      const struct mtd_info_user *mtd);
+int xfer_save(uint32_t size, const char *device,
+	      const struct mtd_info_user *mtd);
+uint32_t xfer_calibrate(struct flash *f);
+
+/* reads are compared per erase block, so round them up to whole blocks */
+static inline uint32_t xfer_read_size(uint32_t size,
+				      const struct mtd_info_user *mtd)
+{
+	return (size + mtd->erasesize - 1) / mtd->erasesize * mtd->erasesize;
+}
+
+#endif /* XFER_H */